@@ -4,6 +4,7 @@
 #include <msclr/marshal_cppstd.h>
 #include "defect_processing.h"
 #include "defect_utils.h"
+#include "pipeline.h"
 
 namespace waferdefectdetection
 {
@@ -23,6 +24,14 @@ namespace waferdefectdetection
       InitializeComponent ();
       current_defects_ = gcnew System::Collections::Generic::List<IntPtr> ();
       has_image_ = false;
+      warm_started_ = false;
+      warm_recipe_ = new Recipe ();
+      warm_report_ = new WarmupReport ();
+      warm_worker_ = gcnew System::ComponentModel::BackgroundWorker ();
+      warm_worker_->DoWork += gcnew System::ComponentModel::DoWorkEventHandler (
+        this, &UI::warm_worker_do_work);
+      warm_worker_->RunWorkerCompleted += gcnew System::ComponentModel::RunWorkerCompletedEventHandler (
+        this, &UI::warm_worker_completed);
     }
 
   protected:
@@ -53,6 +62,12 @@ namespace waferdefectdetection
 
     /* State */
     bool has_image_;
+    bool warm_started_;
+    int warm_width_;
+    int warm_height_;
+    Recipe* warm_recipe_;
+    WarmupReport* warm_report_;
+    System::ComponentModel::BackgroundWorker^ warm_worker_;
     cv::Mat* stored_gray_;
     cv::Mat* stored_corrected_;
     cv::Mat* stored_mask_;
@@ -128,7 +143,7 @@ namespace waferdefectdetection
       this->lbl_defect_info_->Font = (gcnew System::Drawing::Font(L"Microsoft Sans Serif", 10));
       this->lbl_defect_info_->Location = System::Drawing::Point(552, 565);
       this->lbl_defect_info_->Name = L"lbl_defect_info_";
-      this->lbl_defect_info_->Size = System::Drawing::Size(320, 47);
+      this->lbl_defect_info_->Size = System::Drawing::Size(320, 64);
       this->lbl_defect_info_->TabIndex = 11;
       this->lbl_defect_info_->Text = L"Click a defect to inspect it here";
       // 
@@ -284,6 +299,14 @@ namespace waferdefectdetection
         d.center.x,
         d.center.y,
         d.ar);
+
+      if (d.polarity == "dark")
+        lbl_defect_info_->Text += L"  (dark)";
+
+      if (d.type == "scratch")
+        lbl_defect_info_->Text += System::String::Format (
+          "\nLength: {0:F1} px  Width: {1:F1} px  Curv: {2:F3}",
+          d.length, d.width, d.curvature);
     }
 
     void
@@ -359,6 +382,49 @@ namespace waferdefectdetection
       select_defect (idx);
     }
 
+    /* Builds the recipe Analyze will run from the current controls.  */
+    Recipe
+    current_recipe (void)
+    {
+      Recipe recipe;
+      recipe.illumination.blur_size = static_cast<int> (nud_blur_->Value);
+      recipe.detect.threshold = static_cast<int> (nud_threshold_->Value);
+      return recipe;
+    }
+
+    /* Warms the pipeline once, off the UI thread, at the size of the
+       first loaded image and with the recipe the controls hold then.  */
+    void
+    start_warm_up (void)
+    {
+      warm_started_ = true;
+      warm_width_ = stored_gray_->cols;
+      warm_height_ = stored_gray_->rows;
+      *warm_recipe_ = current_recipe ();
+      warm_worker_->RunWorkerAsync ();
+    }
+
+    System::Void
+    warm_worker_do_work (System::Object^ sender,
+                         System::ComponentModel::DoWorkEventArgs^ e)
+    {
+      *warm_report_ = warm_up (cv::Size (warm_width_, warm_height_),
+                               *warm_recipe_);
+    }
+
+    System::Void
+    warm_worker_completed (System::Object^ sender,
+                           System::ComponentModel::RunWorkerCompletedEventArgs^ e)
+    {
+      if (e->Error != nullptr)
+        return;
+
+      this->Text = System::String::Format (
+        "Wafer Defect Inspector  |  Warm-up: {0:F0} ms, first result {1:F0} ms, warm {2:F0} ms",
+        warm_report_->startup_ms, warm_report_->first_result_ms,
+        warm_report_->warm_result_ms);
+    }
+
     System::Void
     btn_load_click (System::Object^ sender, System::EventArgs^ e)
     {
@@ -383,6 +449,9 @@ namespace waferdefectdetection
       cv::cvtColor (img, *stored_gray_, cv::COLOR_BGR2GRAY);
       *stored_mask_ = extract_lens_mask (*stored_gray_);
 
+      if (!warm_started_)
+        start_warm_up ();
+
       pb_original_->Image = Image::FromFile (dlg_->FileName);
       pb_analyzed_->Image = nullptr;
       pb_zoom_->Image = nullptr;
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "defect_processing.h"
+#include <string>
+
+/* Deterministic lens-like test image: a vignetted disc with noise, a few
+   specks and a scratch, on a black surround.  */
+cv::Mat
+make_synthetic_wafer (cv::Size size);
+
+/* Picks the fastest implementation variant of the blur, top-hat and
+   labeling stages for images of SIZE on this machine and writes the
+   choice into RECIPE.  Results are persisted in CACHE_PATH keyed by CPU
+   features, thread count, image shape and the recipe's blur size,
+   top-hat scales, polarity and threshold, so the microbenchmarks run
+   only the first time such a combination is seen.  Returns true if the
+   choice came from the cache.  */
+bool
+autotune (cv::Size size, Recipe& recipe, const std::string& cache_path);
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "pipeline.h"
+
+/* Two-tier inspection.  Every wafer gets the screen: the recipe run on a
+   DECIMATION-times smaller copy with the blur and top-hat scales shrunk
+   to match and a more sensitive SCREEN_THRESHOLD, answering only
+   "suspect or not".  A wafer is suspect when its screened defect area,
+   scaled back to full resolution, reaches SCREEN_MARGIN times the
+   recipe's PASS_RATIO of the lens area; the margin is below 1 because
+   decimation blurs away part of each defect.  Suspects, plus a random
+   AUDIT_RATE share of the rest, go through the full pipeline.  The
+   audited clean-screened wafers are what the screen's miss rate is
+   measured on.  */
+struct CascadeParams
+{
+  int decimation = 4;
+  int screen_threshold = 10;
+  double screen_margin = 0.5;
+  double audit_rate = 0.02;
+};
+
+struct CascadeStats
+{
+  int screened = 0;
+  int flagged = 0;
+  int audited = 0;
+  /* Audited wafers the screen passed but the full pipeline failed.  */
+  int misses = 0;
+  double screen_ms = 0.0;
+  double full_ms = 0.0;
+};
+
+struct CascadeResult
+{
+  bool suspect = false;
+  bool audited = false;
+  /* Filled only when the full pipeline ran; otherwise the wafer passes
+     on the screen alone and INSPECTION holds no images or defects.  */
+  bool full = false;
+  InspectionResult inspection;
+  cv::Mat display;
+};
+
+/* Screen verdict for GRAY under RECIPE.  */
+bool
+screen_wafer (const cv::Mat& gray, const Recipe& recipe,
+              const CascadeParams& params);
+
+/* Screens GRAY, runs inspect and build_annotated_display when it is
+   flagged or drawn for audit from RNG, and accumulates into STATS.  */
+CascadeResult
+inspect_cascade (const cv::Mat& gray, const Recipe& recipe,
+                 const CascadeParams& params, CascadeStats& stats,
+                 cv::RNG& rng);
+
+/* MISSES / AUDITED clean-screened wafers, or 0 before any audit.  */
+double
+estimated_miss_rate (const CascadeStats& stats);
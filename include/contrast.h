@@ -0,0 +1,29 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+/* CLAHE restricted to the non-zero pixels of MASK.  Tile histograms and
+   clip limits are built from in-mask pixels only, tiles with no in-mask
+   pixel are skipped and left out of the interpolation, and pixels
+   outside the mask come out as 0.  Same CLIP_LIMIT semantics as
+   cv::createCLAHE; cost is independent of the tile grid.  */
+cv::Mat
+masked_clahe (const cv::Mat& src, const cv::Mat& mask, double clip_limit,
+              cv::Size tiles);
+
+/* Computes (NUM + 1) / (DEN + 1) for two CV_32F images and stretches it
+   into the CV_8U image DST between the LOW and HIGH percentiles (0..100)
+   of its in-mask values, taken from one histogram pass.  Pixels outside
+   MASK are 0.  DST is reused when it already has the right size and
+   type.  */
+void
+stretch_ratio_percentile (const cv::Mat& num, const cv::Mat& den,
+                          const cv::Mat& mask, float low, float high,
+                          cv::Mat& dst);
+
+/* As above for a flat-field ratio (GRAY + 1) * GAIN, GRAY being CV_8U
+   and GAIN CV_32F.  */
+void
+stretch_gain_percentile (const cv::Mat& gray, const cv::Mat& gain,
+                         const cv::Mat& mask, float low, float high,
+                         cv::Mat& dst);
\ No newline at end of file
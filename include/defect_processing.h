@@ -1,19 +1,187 @@
 #pragma once
 
-#include "defect_utils.h"
+#include "defect_types.h"
+#include "illumination.h"
+#include "zones.h"
 #include <vector>
 
+enum class Normalization
+{
+  min_max,
+  percentile
+};
+
+enum class BackgroundEstimator
+{
+  gaussian,
+  polynomial,
+  median
+};
+
+struct IlluminationParams
+{
+  BackgroundEstimator estimator = BackgroundEstimator::gaussian;
+  int blur_size = 201;
+  bool decimated_blur = false;
+  int poly_degree = 3;
+  int median_downsample = 4;
+  Normalization normalization = Normalization::min_max;
+  float low_percentile = 0.5f;
+  float high_percentile = 99.5f;
+};
+
+struct DetectParams
+{
+  int threshold = 17;
+  /* Area opening limit.  The former open with a 3x3 elliptical kernel
+     (a cross) kept every blob holding a 5 pixel plus, so 5 drops
+     nothing it kept.  It does keep some it removed: 5 to 8 pixel blobs
+     without a plus and thin lines.  */
+  int min_area = 5;
+  double clahe_clip = 3.0;
+  cv::Size clahe_tiles = { 8, 8 };
+  bool masked_clahe = false;
+  std::vector<int> tophat_scales = { 7 };
+  bool detect_dark = false;
+  bool banded_tophat = false;
+  int ccl_algorithm = cv::CCL_DEFAULT;
+};
+
+/* Shape limits analyze_defects classifies by: a blob is a scratch when
+   its bounding box aspect ratio is above SCRATCH_AR_HIGH or at most
+   SCRATCH_AR_LOW and its area exceeds SCRATCH_MIN_AREA, otherwise a
+   cluster above CLUSTER_MIN_AREA and a speck below.  */
+struct ClassifyParams
+{
+  float scratch_ar_high = 2.5f;
+  float scratch_ar_low = 0.70f;
+  float scratch_min_area = 5.0f;
+  float cluster_min_area = 150.0f;
+};
+
+/* One radial zone of a zoned recipe, from the previous zone's
+   OUTER_RADIUS (or the centre) out to its own, as a fraction of the
+   fitted wafer radius.  Zones replace the recipe's global threshold and
+   classification limits; pixels beyond the last zone are not
+   inspected, which is how an edge exclusion band is expressed.  */
+struct ZoneParams
+{
+  float outer_radius = 1.0f;
+  int threshold = 17;
+  ClassifyParams classify;
+};
+
+struct ZoneStats
+{
+  int defects = 0;
+  int specks = 0;
+  int scratches = 0;
+  int clusters = 0;
+  float area = 0.0f;
+};
+
+struct Recipe
+{
+  IlluminationParams illumination;
+  DetectParams detect;
+  ClassifyParams classify;
+  /* Empty for a single global zone; otherwise ascending OUTER_RADIUS.  */
+  std::vector<ZoneParams> zones;
+  float pass_ratio = 0.000005f;
+};
+
+/* Pixel values of the defect mask returned by detect_defects.  */
+const uchar DEFECT_BRIGHT = 255;
+const uchar DEFECT_DARK = 128;
+
 cv::Mat
 extract_lens_mask (const cv::Mat& gray);
 
+cv::Mat
+correct_illumination (const cv::Mat& gray, const cv::Mat& mask,
+                      const IlluminationParams& params);
+
+/* Writes into CORRECTED, reusing its buffer when it already is a CV_8U
+   image of the right size (e.g. a wrapped caller buffer).  */
+void
+correct_illumination (const cv::Mat& gray, const cv::Mat& mask,
+                      const IlluminationParams& params, cv::Mat& corrected);
+
 cv::Mat
 correct_illumination (const cv::Mat& gray, const cv::Mat& mask, int blur_size);
 
 cv::Mat
-detect_defects (const cv::Mat& corrected, const cv::Mat& mask, int threshold);
+correct_illumination (const cv::Mat& gray, const cv::Mat& mask,
+                      const BackgroundModel& model,
+                      const IlluminationParams& params,
+                      FlatFieldReport* report = nullptr);
+
+cv::Mat
+detect_defects (const cv::Mat& corrected, const cv::Mat& mask,
+                const DetectParams& params);
+
+/* Writes into DEFECT_MASK, reusing its buffer like correct_illumination.  */
+void
+detect_defects (const cv::Mat& corrected, const cv::Mat& mask,
+                const DetectParams& params, cv::Mat& defect_mask);
+
+cv::Mat
+detect_defects (const cv::Mat& corrected, const cv::Mat& mask, int threshold,
+                int min_area = 5);
+
+/* Several threshold / min_area cuts of one detection.  CLAHE and the
+   top-hat bank run once with the remaining fields of VARIANTS[0], and
+   every cut is thresholded in a single pass over the response.  Returns
+   one defect mask per variant; variants with equal cuts share a Mat.  */
+std::vector<cv::Mat>
+detect_defects (const cv::Mat& corrected, const cv::Mat& mask,
+                const std::vector<DetectParams>& variants);
+
+/* Zoned detection: ZONES[k].threshold applies to the runs of zone k in
+   ZONE_MAP, the other fields come from PARAMS.  */
+void
+detect_defects (const cv::Mat& corrected, const cv::Mat& mask,
+                const DetectParams& params,
+                const std::vector<ZoneParams>& zones,
+                const ZoneMap& zone_map, cv::Mat& defect_mask);
 
 std::vector<Defect>
-analyze_defects (const cv::Mat& defect_mask);
+analyze_defects (const cv::Mat& defect_mask,
+                 const ClassifyParams& params = ClassifyParams ());
+
+/* The external CHAIN_APPROX_NONE contours analyze_defects works on, in
+   its order, with the defect mask value (polarity) of each.  Bright and
+   dark blobs are traced separately, so touching ones stay apart.  */
+void
+defect_contours (const cv::Mat& defect_mask,
+                 std::vector<std::vector<cv::Point>>& contours,
+                 std::vector<uchar>& values);
+
+/* The per-blob steps of analyze_defects, for callers that analyze
+   components one at a time.  describe_defect fills the geometry and
+   polarity (MASK_VALUE as given by defect_contours) from an external
+   CHAIN_APPROX_NONE contour and returns false for blobs analyze_defects
+   skips; classify_defect sets the type; measure_scratch adds the
+   skeleton metrics.  */
+bool
+describe_defect (const std::vector<cv::Point>& contour, uchar mask_value,
+                 Defect& d);
+
+void
+classify_defect (Defect& d, const ClassifyParams& params);
+
+void
+measure_scratch (const std::vector<cv::Point>& contour, Defect& d);
+
+/* Classifies each defect with the limits of the zone its centre falls
+   in and records that zone in Defect::zone.  */
+std::vector<Defect>
+analyze_defects (const cv::Mat& defect_mask,
+                 const std::vector<ZoneParams>& zones,
+                 const ZoneMap& zone_map);
+
+std::vector<ZoneStats>
+zone_statistics (const std::vector<Defect>& defects, int zone_count);
 
 cv::Mat
 build_annotated_display (const cv::Mat& corrected, const cv::Mat& mask,
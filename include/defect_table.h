@@ -0,0 +1,107 @@
+#pragma once
+
+#include "defect_processing.h"
+
+struct IntensityStats
+{
+  float mean = 0.0f;
+  float stddev = 0.0f;
+  uchar min = 0;
+  uchar max = 0;
+};
+
+/* Defects of one defect mask, computed only as far as they are asked
+   for.  Construction traces the mask once, as analyze_defects does, and
+   keeps per defect only its chain-coded outline, bounding box, contour
+   area and polarity, so the table does not hold on to the full-size
+   images.  Everything else is derived from the outline on first access
+   and cached.  Not safe for concurrent first access from several
+   threads.  */
+class DefectTable
+{
+public:
+  DefectTable () = default;
+
+  /* INTENSITY, when given, is the CV_8U image the defects were found in
+     (usually the corrected image); CROP_MARGIN pixels of it are kept
+     around each box for intensity () and crop ().  Leave it empty when
+     neither is needed.  */
+  explicit DefectTable (const cv::Mat& defect_mask,
+                        const ClassifyParams& params = ClassifyParams (),
+                        const cv::Mat& intensity = cv::Mat (),
+                        int crop_margin = 8);
+
+  /* Defects analyze_defects would report, indexed in its order.  */
+  int
+  size () const;
+
+  /* Contour area, as in Defect::area.  */
+  float
+  area (int i) const;
+
+  cv::Rect
+  box (int i) const;
+
+  /* Centroid and principal axis angle (radians) of the defect, from
+     the moments of its outline.  */
+  cv::Point2f
+  center (int i) const;
+
+  float
+  orientation (int i) const;
+
+  /* Statistics of the intensity image inside the outline; zeros
+     without an intensity image.  */
+  IntensityStats
+  intensity (int i) const;
+
+  const ChainCode&
+  outline (int i) const;
+
+  /* Intensity image around the box, CROP_MARGIN pixels wide; empty
+     without an intensity image.  */
+  cv::Mat
+  crop (int i) const;
+
+  /* Defect I as analyze_defects reports it.  */
+  void
+  defect (int i, Defect& out) const;
+
+  /* The list analyze_defects would return, in the same order.  The
+     first call classifies every defect.  */
+  const std::vector<Defect>&
+  defects () const;
+
+private:
+  struct Component
+  {
+    cv::Rect box;
+    float area = 0.0f;
+    uchar value = 0;
+    ChainCode outline;
+  };
+
+  /* Filled on first access to a component; the vector is sized on
+     first access to any.  */
+  struct Details
+  {
+    std::vector<cv::Point> contour;
+    bool has_moments = false;
+    cv::Moments moments;
+  };
+
+  Details&
+  details (int i) const;
+
+  const cv::Moments&
+  moments (int i) const;
+
+  ClassifyParams params_;
+  std::vector<Component> components_;
+  /* One per component when built with an intensity image.  */
+  std::vector<cv::Rect> crop_boxes_;
+  std::vector<cv::Mat> crops_;
+  mutable std::vector<Details> details_;
+  mutable bool analyzed_ = false;
+  mutable std::vector<Defect> defects_;
+};
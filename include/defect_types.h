@@ -0,0 +1,20 @@
+#pragma once
+
+#include "outline.h"
+#include <opencv2/opencv.hpp>
+#include <string>
+
+struct Defect
+{
+	cv::Point2f center;
+	cv::Rect boundingBox;
+	float area;
+	float ar;
+	std::string type;
+	std::string polarity = "bright";
+	float length = 0.0f;
+	float width = 0.0f;
+	float curvature = 0.0f;
+	int zone = -1;
+	ChainCode outline;
+};
\ No newline at end of file
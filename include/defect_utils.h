@@ -1,17 +1,8 @@
 #pragma once
 
-#include <opencv2/opencv.hpp>
+#include "defect_types.h"
 #include <msclr/marshal_cppstd.h>
 
-struct Defect
-{
-	cv::Point2f center;
-	cv::Rect boundingBox;
-	float area;
-	float ar;
-	std::string type;
-};
-
 std::string
 to_std_string (System::String^ s);
 
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+/* Static illumination field for one tool and optics setup, learned from
+   flat (defect free) wafers.  BACKGROUND holds the per-pixel median of
+   the smoothed flats in 8.8 fixed point; GAIN is 1 / (background + 1),
+   derived on build and load so correction is a single multiply.
+   REFERENCE_DRIFT is the worst drift seen on the calibration flats;
+   recalibration is due once a wafer exceeds it by DRIFT_LIMIT.  */
+struct BackgroundModel
+{
+  cv::Mat background;
+  cv::Mat gain;
+  int blur_size = 0;
+  double reference_drift = 0.0;
+  double drift_limit = 0.05;
+};
+
+struct FlatFieldReport
+{
+  double drift = 0.0;
+  bool needs_recalibration = false;
+};
+
+BackgroundModel
+build_background_model (const std::vector<cv::Mat>& flats, int blur_size);
+
+bool
+save_background_model (const BackgroundModel& model, const std::string& path);
+
+/* Returns a model with an empty background if PATH cannot be read.  */
+BackgroundModel
+load_background_model (const std::string& path);
+
+/* Residual low-frequency non-uniformity of GRAY after flat-fielding with
+   MODEL, measured on 16x decimated block means inside MASK.  A drifting
+   lamp or moved optics shows up as a spread well above what the
+   calibration flats had.  */
+FlatFieldReport
+check_background_drift (const cv::Mat& gray, const cv::Mat& mask,
+                        const BackgroundModel& model);
+
+/* Least-squares fit of a 2-D polynomial of total degree DEGREE (1..4) to
+   block means of IMAGE on a GRID x GRID lattice, using only blocks fully
+   inside MASK.  Samples beyond 2.5 robust sigmas (defects, particles) are
+   rejected and the fit repeated.  The surface is evaluated row by row
+   with forward differences, so cost is a few adds per pixel whatever
+   the blur size it replaces.  Returns a CV_32F background, clamped at 0.  */
+cv::Mat
+fit_polynomial_background (const cv::Mat& image, const cv::Mat& mask,
+                           int degree, int grid = 64);
+
+/* The same fit applied as a flat field: writes (IMAGE + 1) / (surface
+   + 1) into the CV_32F image RATIO, evaluating the surface inside the
+   divide so it is never stored.  IMAGE must be CV_32F.  */
+void
+polynomial_flat_field (const cv::Mat& image, const cv::Mat& mask, int degree,
+                       cv::Mat& ratio, int grid = 64);
+
+/* Masked sliding-window median of the CV_8U image GRAY over a WINDOW
+   pixel square, using the constant-time column histogram method of
+   Perreault and Hebert on a DOWNSAMPLE-times decimated copy.  Only
+   pixels inside MASK enter the histograms, so the dark surround does not
+   pull the estimate down near the lens edge, and large bright clusters
+   cannot lift it the way they lift a Gaussian.  Returns a CV_32F
+   background at full size.  */
+cv::Mat
+median_background (const cv::Mat& gray, const cv::Mat& mask, int window,
+                   int downsample = 4);
\ No newline at end of file
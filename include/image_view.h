@@ -0,0 +1,40 @@
+#pragma once
+
+#include "pipeline.h"
+
+enum class PixelFormat
+{
+  gray8,
+  bgr24,
+  bgra32
+};
+
+/* A caller-owned frame buffer.  STRIDE is in bytes and may exceed
+   WIDTH times the pixel size (padded rows).  */
+struct ImageView
+{
+  void* data = nullptr;
+  int width = 0;
+  int height = 0;
+  size_t stride = 0;
+  PixelFormat format = PixelFormat::gray8;
+};
+
+/* A cv::Mat header over VIEW's memory; nothing is copied and the Mat
+   does not own the buffer.  The Mat, and anything sharing its data, is
+   only valid while the caller keeps the buffer alive and unmodified by
+   other writers.  */
+cv::Mat
+wrap_view (const ImageView& view);
+
+/* Runs inspect on a caller frame buffer in place.  A gray8 input is
+   read directly; colour inputs are converted to grey once.  When given,
+   CORRECTED_OUT and DEFECT_MASK_OUT must be gray8 views of the input's
+   size: the final stage of each writes straight into them and the
+   result's corrected and defect_mask then alias the caller's memory,
+   under the same lifetime rule as wrap_view.  Throws cv::Exception on
+   a size or format mismatch.  */
+InspectionResult
+inspect_view (const ImageView& input, const Recipe& recipe,
+              const ImageView* corrected_out = nullptr,
+              const ImageView* defect_mask_out = nullptr);
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+struct SkeletonMetrics
+{
+  float length = 0.0f;
+  float width = 0.0f;
+  float curvature = 0.0f;
+};
+
+/* Zhang-Suen thinning of a binary (non-zero = foreground) image.
+   Returns a one pixel wide, 8-connected skeleton as 0/255.  */
+cv::Mat
+thin_zhang_suen (const cv::Mat& binary);
+
+/* Thins a single filled component, prunes spurs shorter than its
+   estimated half width and measures the remaining centre line.  */
+SkeletonMetrics
+measure_skeleton (const cv::Mat& component);
+
+/* Binary area opening, in place: drops 8-connected components smaller
+   than MIN_AREA pixels and leaves every other component untouched, pixel
+   values included.  */
+void
+area_open (cv::Mat& binary, int min_area,
+           int ccl_algorithm = cv::CCL_DEFAULT);
+
+/* Multi-scale top-hat.  OP is cv::MORPH_OPEN for the white (bright on
+   dark) top-hat or cv::MORPH_CLOSE for the black one.  SCALES must be
+   ascending; the first one is a full resolution elliptical kernel,
+   exactly the classic top-hat.  Each larger opening (closing) is derived
+   from the previous one on an image decimated so the kernel stays near
+   SCALES[0] wide, which keeps the total cost close to that of a single
+   scale.  Returns the per-pixel maximum of the granulometric bands
+   |f - O0|, |O0 - O1|, ..., so a defect responds at full contrast in the
+   band that matches its width and a single threshold merges detections
+   across scales.  The bands equal per-scale top-hats only for nested
+   flat structuring elements; the digital and decimated ellipses used
+   here make the coarser ones an approximation.  BANDED runs the full
+   resolution filter over horizontal bands in parallel so each band's
+   erode, dilate and subtract stay in cache; that does not change the
+   result.  */
+cv::Mat
+tophat_bank (const cv::Mat& src, const std::vector<int>& scales,
+             int op = cv::MORPH_OPEN, bool banded = false);
+
+/* White and black top-hat banks of SRC together, equal to the OPEN and
+   CLOSE calls above.  The full resolution erosion and dilation of SRC
+   run in the same banded pass, so the source is read once for both
+   polarities.  */
+void
+tophat_bank (const cv::Mat& src, const std::vector<int>& scales,
+             cv::Mat& white, cv::Mat& black);
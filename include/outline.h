@@ -0,0 +1,28 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <vector>
+
+/* Closed 8-connected boundary of POINTS pixels (0 for none) as a start
+   point and POINTS - 1 Freeman directions (0 east, counter-clockwise in
+   45 degree steps, y pointing down) packed three bits each.  */
+struct ChainCode
+{
+  cv::Point start;
+  uint32_t points = 0;
+  std::vector<uint8_t> bits;
+};
+
+/* CONTOUR must list every boundary pixel in order, as findContours
+   returns with cv::CHAIN_APPROX_NONE.  */
+ChainCode
+encode_chain (const std::vector<cv::Point>& contour);
+
+std::vector<cv::Point>
+decode_chain (const ChainCode& chain);
+
+/* The boundary simplified by Douglas-Peucker to within EPSILON pixels,
+   for rendering or export.  */
+std::vector<cv::Point>
+outline_polygon (const ChainCode& chain, double epsilon = 1.0);
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "defect_table.h"
+
+struct InspectionResult
+{
+  cv::Mat mask;
+  cv::Mat corrected;
+  cv::Mat defect_mask;
+  std::vector<Defect> defects;
+  /* Per-zone counts for zoned recipes, indexed like Recipe::zones.  */
+  std::vector<ZoneStats> zone_stats;
+  /* Filled instead of DEFECTS by verdict-only runs (analyze_batch
+     without KEEP_IMAGES); it holds the defects analyze_defects would
+     list, in the same order.  */
+  DefectTable table;
+  float ratio = 0.0f;
+  bool pass = true;
+
+  /* DEFECTS, or TABLE's defects for verdict-only results.  The first
+     call on those classifies every defect and, like any first access to
+     the table, must not race with another.  */
+  const std::vector<Defect>&
+  all_defects () const;
+
+  /* Number of defects in all_defects (), without analyzing them.  */
+  size_t
+  defect_count () const;
+};
+
+struct WarmupReport
+{
+  double startup_ms = 0.0;
+  double first_result_ms = 0.0;
+  double warm_result_ms = 0.0;
+};
+
+/* Full inspection of one grey image: lens mask, illumination
+   correction, detection, analysis and the pass/fail verdict.  */
+InspectionResult
+inspect (const cv::Mat& gray, const Recipe& recipe);
+
+/* As inspect, but writes the corrected image and defect mask into the
+   buffers RESULT already holds when their size and type fit.  */
+void
+inspect_into (const cv::Mat& gray, const Recipe& recipe,
+              InspectionResult& result);
+
+/* The stages after illumination correction: detection, analysis and
+   the verdict, on the mask and corrected image RESULT already holds.  */
+void
+inspect_corrected (const Recipe& recipe, InspectionResult& result);
+
+/* Inspects GRAY_IMAGES under one RECIPE and returns the results in
+   input order.  Images are scheduled grouped by size, and when the batch
+   is at least as large as the thread pool each worker takes whole images
+   (the stages inside then run serially) so small images do not pay for
+   per-stage fork/join.  Unless KEEP_IMAGES is set each worker reuses one
+   set of intermediate buffers for all its images and the results carry
+   only the verdict and a lazy DefectTable: defect attributes are then
+   computed only for wafers whose table is read.  Zoned recipes still
+   get the full defect list and zone statistics.  */
+std::vector<InspectionResult>
+analyze_batch (const std::vector<cv::Mat>& gray_images, const Recipe& recipe,
+               bool keep_images = false);
+
+/* Runs every recipe in RECIPES on GRAY and returns one result per
+   recipe, in order.  Unzoned recipes that differ only in threshold,
+   min_area, classification limits or pass_ratio share the lens mask,
+   illumination correction and top-hat, with all their threshold cuts
+   taken in one pass; the results then share the mask and corrected
+   images.  Meant for qualification runs comparing several variants of
+   one recipe.  */
+std::vector<InspectionResult>
+inspect_variants (const cv::Mat& gray, const std::vector<Recipe>& recipes);
+
+/* Primes the OpenCV thread pool, lazy library state and allocator by
+   running RECIPE twice on a synthetic image of SIZE.  Call at service
+   start or on recipe load so the first real wafer does not pay for it.
+   STARTUP_MS covers library and pool initialisation, FIRST_RESULT_MS the
+   cold pipeline run and WARM_RESULT_MS the steady-state run after it.  */
+WarmupReport
+warm_up (cv::Size size, const Recipe& recipe);
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct io_uring;
+
+/* Reads and decodes a list of image files ahead of the consumer, so the
+   disk and the decoders work while the caller runs the pipeline on the
+   previous image.  Up to DEPTH files are in flight at once, each in a
+   slot whose page-aligned file buffer is reused for later files.
+
+   Built with WAFER_WITH_IO_URING (Linux, liburing), one thread keeps
+   DEPTH reads queued on an io_uring and DECODE_THREADS threads decode
+   completed buffers.  Otherwise each of the DECODE_THREADS threads
+   reads its file with blocking I/O and decodes it.  */
+class PrefetchReader
+{
+public:
+  PrefetchReader (const std::vector<std::string>& paths, int depth = 4,
+                  int decode_threads = 2,
+                  int imread_flags = cv::IMREAD_GRAYSCALE);
+  ~PrefetchReader ();
+
+  PrefetchReader (const PrefetchReader&) = delete;
+  PrefetchReader& operator= (const PrefetchReader&) = delete;
+
+  /* Next image in PATHS order; false once every path has been returned.
+     Like cv::imread, IMAGE is empty when the file could not be read or
+     decoded.  */
+  bool
+  next (cv::Mat& image, std::string* path = nullptr);
+
+  bool
+  uses_io_uring () const;
+
+private:
+  enum class SlotState
+  {
+    free,
+    loading,
+    loaded,
+    decoding,
+    ready
+  };
+
+  struct Slot
+  {
+    std::vector<uchar> storage;
+    uchar* data = nullptr;
+    size_t size = 0;
+    size_t index = 0;
+    SlotState state = SlotState::free;
+    cv::Mat image;
+  };
+
+  Slot&
+  slot_for (size_t index);
+
+  void
+  reserve (Slot& slot, size_t size);
+
+  bool
+  read_file (const std::string& path, Slot& slot);
+
+  void
+  decode_loop ();
+
+  void
+  fetch_loop ();
+
+  std::vector<std::string> paths_;
+  int flags_;
+  /* Set up in the constructor, before any thread starts, and fixed from
+     then on.  */
+  io_uring* ring_ = nullptr;
+  bool io_uring_ = false;
+  std::vector<Slot> slots_;
+  std::mutex lock_;
+  std::condition_variable changed_;
+  size_t next_fetch_ = 0;
+  size_t next_decode_ = 0;
+  size_t next_out_ = 0;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
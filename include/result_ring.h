@@ -0,0 +1,191 @@
+#pragma once
+
+#include "pipeline.h"
+#include <atomic>
+#include <cstdint>
+
+/* Inspection results published into a named shared-memory ring so other
+   processes (review station, MES adapter, dashboards) can read them
+   without files, copies or locks on the writer.
+
+   The segment holds a versioned RingHeader followed by SLOTS fixed-size
+   slots.  Each slot is a SlotHeader, the defect table as one column per
+   attribute (MAX_DEFECTS entries each), and room for DISPLAY_BYTES of
+   display image.  Slots are guarded seqlock style: the slot's state is
+   odd while the writer fills it and 2 * SEQUENCE once result SEQUENCE
+   (counting from 1) is complete.  Readers check the state before and
+   after using the data and retry or skip when it moved; the writer
+   never waits for them.
+
+   A publisher that restarts creates a new segment under the same name,
+   and its sequence numbers start again from 1.  Before that it marks
+   the old header as no longer alive, and every segment carries an
+   EPOCH of its own, so subscribers still mapping the old one can tell
+   and reopen.  */
+
+const uint32_t RING_VERSION = 2;
+
+struct RingLayout
+{
+  uint32_t slots = 8;
+  uint32_t max_defects = 4096;
+  uint64_t display_bytes = 0;
+};
+
+struct RingHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t slots;
+  uint32_t max_defects;
+  uint64_t slot_bytes;
+  uint64_t display_bytes;
+  /* Identifies this creation of the segment.  */
+  uint64_t epoch;
+  /* Sequence number of the newest complete result, 0 before any.  */
+  std::atomic<uint64_t> published;
+  /* 1 while the publisher that created the segment owns it.  */
+  std::atomic<uint32_t> alive;
+};
+
+struct SlotHeader
+{
+  std::atomic<uint64_t> state;
+  uint64_t sequence;
+  uint64_t wafer_id;
+  int64_t time_us;
+  uint32_t pass;
+  float ratio;
+  /* Defects found; only the first DEFECT_COUNT fit the columns.  */
+  uint32_t total_defects;
+  uint32_t defect_count;
+  int32_t display_rows;
+  int32_t display_cols;
+  int32_t display_type;
+  uint32_t reserved;
+};
+
+/* Column order in a slot; each column is aligned to 64 bytes.  */
+enum RingColumn
+{
+  COLUMN_CENTER_X,
+  COLUMN_CENTER_Y,
+  COLUMN_BOX_X,
+  COLUMN_BOX_Y,
+  COLUMN_BOX_WIDTH,
+  COLUMN_BOX_HEIGHT,
+  COLUMN_AREA,
+  COLUMN_ASPECT_RATIO,
+  COLUMN_LENGTH,
+  COLUMN_WIDTH,
+  COLUMN_CURVATURE,
+  COLUMN_TYPE,
+  COLUMN_POLARITY,
+  COLUMN_ZONE,
+  COLUMN_COUNT
+};
+
+class SharedSegment;
+
+/* A complete result read in place from the ring.  The pointers stay
+   inside shared memory; once done with them call valid () and discard
+   anything read if it returns false, as the writer has reused the slot.  */
+struct ResultView
+{
+  uint64_t sequence = 0;
+  uint64_t wafer_id = 0;
+  int64_t time_us = 0;
+  bool pass = true;
+  float ratio = 0.0f;
+  uint32_t total_defects = 0;
+  uint32_t defect_count = 0;
+  const float* center_x = nullptr;
+  const float* center_y = nullptr;
+  const int32_t* box_x = nullptr;
+  const int32_t* box_y = nullptr;
+  const int32_t* box_width = nullptr;
+  const int32_t* box_height = nullptr;
+  const float* area = nullptr;
+  const float* aspect_ratio = nullptr;
+  const float* length = nullptr;
+  const float* width = nullptr;
+  const float* curvature = nullptr;
+  /* 0 speck, 1 scratch, 2 cluster; 0 bright, 1 dark; zone or -1.  */
+  const int8_t* type = nullptr;
+  const int8_t* polarity = nullptr;
+  const int8_t* zone = nullptr;
+  /* Non-owning header over the slot, empty when none was published.  */
+  cv::Mat display;
+
+  bool
+  valid () const;
+
+  const std::atomic<uint64_t>* slot_state = nullptr;
+};
+
+class ResultPublisher
+{
+public:
+  /* Creates (or recreates) the segment NAME.  On Windows a segment some
+     reader still maps is reused in place, and when it is too small for
+     LAYOUT the publisher stays closed (is_open () false).  */
+  ResultPublisher (const std::string& name,
+                   const RingLayout& layout = RingLayout ());
+  ~ResultPublisher ();
+
+  ResultPublisher (const ResultPublisher&) = delete;
+  ResultPublisher& operator= (const ResultPublisher&) = delete;
+
+  bool
+  is_open () const;
+
+  /* Publishes RESULT and, when it fits the layout, DISPLAY; returns the
+     result's sequence number, or 0 if the ring is not open.  Defects
+     beyond MAX_DEFECTS are counted but not stored.  Single writer: one
+     thread of one process may publish to a ring at a time.  */
+  uint64_t
+  publish (const InspectionResult& result, const cv::Mat& display = cv::Mat (),
+           uint64_t wafer_id = 0);
+
+private:
+  SharedSegment* segment_;
+};
+
+class ResultSubscriber
+{
+public:
+  /* Maps the existing segment NAME read-only.  */
+  explicit ResultSubscriber (const std::string& name);
+  ~ResultSubscriber ();
+
+  ResultSubscriber (const ResultSubscriber&) = delete;
+  ResultSubscriber& operator= (const ResultSubscriber&) = delete;
+
+  bool
+  is_open () const;
+
+  /* Sequence number of the newest complete result, 0 before any.  */
+  uint64_t
+  latest () const;
+
+  /* Views result SEQUENCE; false if it is not yet published or has
+     already been overwritten.  */
+  bool
+  view (uint64_t sequence, ResultView& out) const;
+
+  /* True once the publisher of the mapped segment has shut down or
+     restarted; LATEST then no longer advances.  */
+  bool
+  retired () const;
+
+  /* Maps the current segment of the name again, e.g. after retired ().
+     Views of the old segment become invalid, and sequence numbers of
+     the new one start from 1.  */
+  bool
+  reopen ();
+
+private:
+  std::string name_;
+  uint64_t epoch_ = 0;
+  SharedSegment* segment_;
+};
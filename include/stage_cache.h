@@ -0,0 +1,70 @@
+#pragma once
+
+#include "pipeline.h"
+#include <list>
+#include <map>
+#include <mutex>
+
+/* Persistent cache of the lens mask and illumination-corrected image,
+   keyed by a hash of the image content and the illumination parameters,
+   so re-inspecting archived wafers with a new detection or
+   classification recipe skips the upstream stages.  Masks are stored as
+   PNG and corrected images as tile archives, both read back through a
+   memory mapping.  Entries beyond MAX_BYTES are evicted least recently
+   used first; the LRU order survives restarts in an index file inside
+   DIRECTORY, which must exist.  Safe to share between threads.  */
+class StageCache
+{
+public:
+  StageCache (const std::string& directory, size_t max_bytes);
+  ~StageCache ();
+
+  StageCache (const StageCache&) = delete;
+  StageCache& operator= (const StageCache&) = delete;
+
+  static std::string
+  key (const cv::Mat& gray, const IlluminationParams& params);
+
+  bool
+  load (const std::string& key, cv::Mat& mask, cv::Mat& corrected);
+
+  void
+  store (const std::string& key, const cv::Mat& mask,
+         const cv::Mat& corrected);
+
+  size_t
+  bytes () const;
+
+private:
+  struct Entry
+  {
+    size_t bytes = 0;
+    std::list<std::string>::iterator position;
+  };
+
+  std::string
+  entry_path (const std::string& key, const char* suffix) const;
+
+  void
+  erase_locked (const std::string& key);
+
+  void
+  save_index_locked ();
+
+  std::string directory_;
+  size_t max_bytes_;
+  size_t bytes_ = 0;
+  /* Least recently used first.  */
+  std::list<std::string> order_;
+  std::map<std::string, Entry> entries_;
+  /* LRU moves not yet written to the index, and when it last was.  */
+  bool index_dirty_ = false;
+  int64 index_saved_ = 0;
+  mutable std::mutex lock_;
+};
+
+/* inspect_into with the mask and corrected image taken from CACHE when
+   present and stored there when not.  */
+void
+inspect_cached (const cv::Mat& gray, const Recipe& recipe, StageCache& cache,
+                InspectionResult& result);
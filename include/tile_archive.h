@@ -0,0 +1,83 @@
+#pragma once
+
+#include "tiled_decode.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/* Lossless archive of one grey image as independently compressed tiles
+   behind a tile index, so a defect crop reads and decodes only the
+   tiles it overlaps.  Tiles use zstd or LZ4 when built with
+   WAFER_WITH_ZSTD or WAFER_WITH_LZ4 and PNG (fast setting) otherwise;
+   the codec is recorded per file, and a reader built without it fails
+   cleanly.  Integers are stored little endian.  */
+
+bool
+write_tile_archive (const std::string& path, const cv::Mat& gray,
+                    cv::Size tile_size = { 256, 256 });
+
+/* Image size from the archive header, or an empty size.  */
+cv::Size
+tile_archive_size (const std::string& path);
+
+/* Decodes the tiles overlapping ROI into CROP (CV_8U, ROI clipped to the
+   image).  */
+bool
+read_tile_archive (const std::string& path, const cv::Rect& roi,
+                   cv::Mat& crop);
+
+/* Decodes every tile on all threads into SINK, as decode_tiles does.  */
+bool
+decode_archive_tiles (const std::string& path, const TileSink& sink);
+
+/* Decodes a whole archive held in memory, e.g. a mapped file, into
+   GRAY.  */
+bool
+decode_tile_archive (const uchar* data, size_t size, cv::Mat& gray);
+
+/* A name next to PATH that no other thread or process writing PATH
+   uses, for writing a file aside and renaming it into place.  */
+std::string
+unique_temp_path (const std::string& path);
+
+/* Renames TEMP over PATH, replacing it if it exists; on failure TEMP is
+   removed and PATH left as it was.  */
+bool
+replace_file (const std::string& temp, const std::string& path);
+
+/* Writes archives on one background thread at the lowest OS priority,
+   so audit storage never competes with inspection.  Images are shared,
+   not copied: callers must not write into a submitted Mat, which must
+   be CV_8U.  An archive that fails or throws is counted by flush.
+   Pending archives are finished before the destructor returns.  */
+class TileArchiveWriter
+{
+public:
+  explicit TileArchiveWriter (cv::Size tile_size = { 256, 256 });
+  ~TileArchiveWriter ();
+
+  TileArchiveWriter (const TileArchiveWriter&) = delete;
+  TileArchiveWriter& operator= (const TileArchiveWriter&) = delete;
+
+  void
+  submit (const std::string& path, const cv::Mat& gray);
+
+  /* Blocks until every submitted archive is written; returns the number
+     that failed since the last call.  */
+  int
+  flush ();
+
+private:
+  void
+  run ();
+
+  cv::Size tile_size_;
+  std::deque<std::pair<std::string, cv::Mat>> queue_;
+  std::mutex lock_;
+  std::condition_variable changed_;
+  bool busy_ = false;
+  bool stop_ = false;
+  int failures_ = 0;
+  std::thread thread_;
+};
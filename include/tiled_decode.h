@@ -0,0 +1,32 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <functional>
+#include <string>
+
+/* Receives one decoded tile: ROI is its place in the full image and
+   TILE a CV_8U grey view of that size, valid only during the call.
+   Sinks are called from decoder threads, several at a time, in no
+   particular order.  */
+using TileSink = std::function<void (const cv::Rect& roi, const cv::Mat& tile)>;
+
+/* Decodes the image at PATH to grey on all threads.  Built with
+   WAFER_WITH_LIBTIFF, tiled and striped 8-bit MinIsBlack or RGB TIFFs
+   are split across threads, each with its own libtiff handle.  Strips
+   of a grey image, and tiles as wide as it, are decoded straight into
+   the returned buffer; narrower tiles are copied there from a
+   per-thread buffer.  libtiff's stderr diagnostics are silenced.  Any
+   other file, or a build without libtiff, goes through cv::imread.
+   Returns an empty Mat when PATH cannot be read.  */
+cv::Mat
+read_gray_tiled (const std::string& path);
+
+/* As read_gray_tiled, but hands each tile to SINK as soon as it is
+   decoded instead of assembling the frame, so tiled processing can
+   start before the whole file is read.  Non-TIFF input is decoded whole
+   and delivered in TILE_SIZE pieces.  Returns false, without calling
+   SINK, when PATH cannot be read.  */
+bool
+decode_tiles (const std::string& path, const TileSink& sink,
+              cv::Size* image_size = nullptr,
+              cv::Size tile_size = { 512, 512 });
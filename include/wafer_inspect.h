@@ -0,0 +1,179 @@
+#pragma once
+
+/* C ABI around the inspection pipeline.  Only C types cross this
+   boundary: handles are opaque, images are caller-owned buffers and
+   defect tables are copied into caller arrays of plain structs.  All
+   functions returning int give WI_OK on success and a negative code on
+   failure, with a message from wi_last_error on the calling thread.  */
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#  ifdef WI_BUILDING
+#    define WI_API __declspec(dllexport)
+#  else
+#    define WI_API __declspec(dllimport)
+#  endif
+#else
+#  define WI_API __attribute__ ((visibility ("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WI_ABI_VERSION 1
+
+enum
+{
+  WI_OK = 0,
+  WI_ERROR_ARGUMENT = -1,
+  WI_ERROR_UNKNOWN_KEY = -2,
+  WI_ERROR_INTERNAL = -3
+};
+
+enum
+{
+  WI_FORMAT_GRAY8 = 0,
+  WI_FORMAT_BGR24 = 1,
+  WI_FORMAT_BGRA32 = 2
+};
+
+enum
+{
+  WI_DEFECT_SPECK = 0,
+  WI_DEFECT_SCRATCH = 1,
+  WI_DEFECT_CLUSTER = 2
+};
+
+enum
+{
+  WI_POLARITY_BRIGHT = 0,
+  WI_POLARITY_DARK = 1
+};
+
+typedef struct wi_context wi_context;
+typedef struct wi_recipe wi_recipe;
+typedef struct wi_result wi_result;
+
+/* Caller-owned pixels; STRIDE in bytes, 0 for tightly packed rows.  The
+   library never keeps a pointer into an image past the call.  */
+typedef struct wi_image
+{
+  void* data;
+  int width;
+  int height;
+  size_t stride;
+  int format;
+} wi_image;
+
+typedef struct wi_defect
+{
+  float center_x;
+  float center_y;
+  int box_x;
+  int box_y;
+  int box_width;
+  int box_height;
+  float area;
+  float aspect_ratio;
+  float length;
+  float width;
+  float curvature;
+  int type;
+  int polarity;
+} wi_defect;
+
+WI_API int
+wi_abi_version (void);
+
+WI_API const char*
+wi_last_error (void);
+
+/* THREADS > 0 sets OpenCV's thread count, which is process-wide: it
+   applies to every context and to other OpenCV users in the process,
+   and the last context created with a count wins.  THREADS <= 0 leaves
+   it unchanged.  */
+WI_API wi_context*
+wi_context_create (int threads);
+
+WI_API void
+wi_context_destroy (wi_context* ctx);
+
+WI_API wi_recipe*
+wi_recipe_create (void);
+
+WI_API void
+wi_recipe_destroy (wi_recipe* recipe);
+
+/* Sets a numeric recipe field by name, e.g. "threshold", "min_area",
+   "blur_size", "estimator", "normalization", "detect_dark",
+   "pass_ratio".  Enumerations take their ordinal.  */
+WI_API int
+wi_recipe_set (wi_recipe* recipe, const char* key, double value);
+
+WI_API int
+wi_recipe_get (const wi_recipe* recipe, const char* key, double* value);
+
+WI_API int
+wi_recipe_set_tophat_scales (wi_recipe* recipe, const int* scales,
+                             size_t count);
+
+/* Stage entry points.  Outputs are gray8 images of the input's size
+   that the library writes into directly.  */
+WI_API int
+wi_extract_lens_mask (wi_context* ctx, const wi_image* gray,
+                      wi_image* mask_out);
+
+WI_API int
+wi_correct_illumination (wi_context* ctx, const wi_recipe* recipe,
+                         const wi_image* gray, const wi_image* mask,
+                         wi_image* corrected_out);
+
+WI_API int
+wi_detect_defects (wi_context* ctx, const wi_recipe* recipe,
+                   const wi_image* corrected, const wi_image* mask,
+                   wi_image* defect_mask_out);
+
+WI_API int
+wi_analyze_defects (wi_context* ctx, const wi_image* defect_mask,
+                    wi_result** result_out);
+
+/* Full inspection.  CORRECTED_OUT and DEFECT_MASK_OUT may be NULL.  */
+WI_API int
+wi_inspect (wi_context* ctx, const wi_recipe* recipe, const wi_image* input,
+            wi_image* corrected_out, wi_image* defect_mask_out,
+            wi_result** result_out);
+
+/* Inspects COUNT images; RESULTS_OUT[i] belongs to INPUTS[i].  */
+WI_API int
+wi_inspect_batch (wi_context* ctx, const wi_recipe* recipe,
+                  const wi_image* inputs, size_t count,
+                  wi_result** results_out);
+
+WI_API void
+wi_result_destroy (wi_result* result);
+
+WI_API int
+wi_result_pass (const wi_result* result);
+
+WI_API double
+wi_result_ratio (const wi_result* result);
+
+/* Cheap for every result: batch results count their defects without
+   analyzing them.  */
+WI_API size_t
+wi_result_defect_count (const wi_result* result);
+
+/* Copies up to CAPACITY defects into DEFECTS; returns the number
+   copied.  Batch results analyze and classify every defect on the
+   first call, which is then the expensive one; calls on one result
+   from several threads are safe.  On failure returns 0 and sets
+   wi_last_error, which a successful call leaves empty.  */
+WI_API size_t
+wi_result_defects (const wi_result* result, wi_defect* defects,
+                   size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
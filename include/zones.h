@@ -0,0 +1,44 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/* Wafer disc fitted to a lens mask: centroid and the radius of the
+   circle with the same area.  */
+struct WaferGeometry
+{
+  cv::Point2f center;
+  float radius = 0.0f;
+};
+
+WaferGeometry
+fit_wafer_geometry (const cv::Mat& mask);
+
+struct ZoneSpan
+{
+  int x0;
+  int x1;
+  int zone;
+};
+
+/* Radial zones of an image as horizontal runs, row Y's runs being
+   SPANS[ROW_START[Y]] up to SPANS[ROW_START[Y + 1]], in increasing x.
+   Pixels beyond the outermost radius belong to no span.  */
+struct ZoneMap
+{
+  cv::Size size;
+  std::vector<int> row_start;
+  std::vector<ZoneSpan> spans;
+};
+
+/* Zone K covers the ring between OUTER_RADII[K - 1] and OUTER_RADII[K]
+   (fractions of GEOMETRY's radius, ascending); zone 0 is the centre
+   disc.  Built once per image so the threshold pass walks runs instead
+   of computing a radius per pixel.  */
+ZoneMap
+build_zone_map (cv::Size size, const WaferGeometry& geometry,
+                const std::vector<float>& outer_radii);
+
+/* Zone of pixel P, or -1 outside every zone.  */
+int
+zone_at (const ZoneMap& map, cv::Point p);
@@ -0,0 +1,350 @@
+"""Python bindings for the wafer inspection pipeline.
+
+Thin ctypes layer over the C ABI in include/wafer_inspect.h, so it needs
+no compiler and follows the shared library's ABI version.  NumPy arrays
+are handed to the library by pointer and stride, and outputs are written
+straight into arrays allocated here or passed in by the caller, so no
+image is copied on either side of the boundary.  ctypes releases the GIL
+for the duration of every library call, so threads running inspections
+in parallel scale like native callers.
+
+The library is looked up in WAFER_INSPECT_LIBRARY, then next to this
+file, then in ../build, then on the system library path.
+"""
+
+import ctypes
+import ctypes.util
+import os
+
+import numpy as np
+
+ABI_VERSION = 1
+
+FORMAT_GRAY8 = 0
+FORMAT_BGR24 = 1
+FORMAT_BGRA32 = 2
+
+DEFECT_SPECK = 0
+DEFECT_SCRATCH = 1
+DEFECT_CLUSTER = 2
+
+POLARITY_BRIGHT = 0
+POLARITY_DARK = 1
+
+# Must match struct wi_defect field for field.
+DEFECT_DTYPE = np.dtype([
+    ("center_x", np.float32),
+    ("center_y", np.float32),
+    ("box_x", np.int32),
+    ("box_y", np.int32),
+    ("box_width", np.int32),
+    ("box_height", np.int32),
+    ("area", np.float32),
+    ("aspect_ratio", np.float32),
+    ("length", np.float32),
+    ("width", np.float32),
+    ("curvature", np.float32),
+    ("type", np.int32),
+    ("polarity", np.int32),
+])
+
+
+class WaferInspectError(RuntimeError):
+    pass
+
+
+class _Image(ctypes.Structure):
+    _fields_ = [
+        ("data", ctypes.c_void_p),
+        ("width", ctypes.c_int),
+        ("height", ctypes.c_int),
+        ("stride", ctypes.c_size_t),
+        ("format", ctypes.c_int),
+    ]
+
+
+def _library_candidates():
+    env = os.environ.get("WAFER_INSPECT_LIBRARY")
+    if env:
+        yield env
+    here = os.path.dirname(os.path.abspath(__file__))
+    for name in ("libwafer_inspect.so", "libwafer_inspect.dylib",
+                 "wafer_inspect.dll"):
+        yield os.path.join(here, name)
+        yield os.path.join(here, os.pardir, "build", name)
+    found = ctypes.util.find_library("wafer_inspect")
+    if found:
+        yield found
+
+
+def _load():
+    for path in _library_candidates():
+        if os.path.sep in path and not os.path.exists(path):
+            continue
+        try:
+            return ctypes.CDLL(path)
+        except OSError:
+            continue
+    raise WaferInspectError("wafer_inspect shared library not found; "
+                            "set WAFER_INSPECT_LIBRARY")
+
+
+_lib = _load()
+
+_ptr = ctypes.c_void_p
+_image_p = ctypes.POINTER(_Image)
+
+for name, restype, argtypes in (
+        ("wi_abi_version", ctypes.c_int, []),
+        ("wi_last_error", ctypes.c_char_p, []),
+        ("wi_context_create", _ptr, [ctypes.c_int]),
+        ("wi_context_destroy", None, [_ptr]),
+        ("wi_recipe_create", _ptr, []),
+        ("wi_recipe_destroy", None, [_ptr]),
+        ("wi_recipe_set", ctypes.c_int,
+         [_ptr, ctypes.c_char_p, ctypes.c_double]),
+        ("wi_recipe_get", ctypes.c_int,
+         [_ptr, ctypes.c_char_p, ctypes.POINTER(ctypes.c_double)]),
+        ("wi_recipe_set_tophat_scales", ctypes.c_int,
+         [_ptr, ctypes.POINTER(ctypes.c_int), ctypes.c_size_t]),
+        ("wi_extract_lens_mask", ctypes.c_int, [_ptr, _image_p, _image_p]),
+        ("wi_correct_illumination", ctypes.c_int,
+         [_ptr, _ptr, _image_p, _image_p, _image_p]),
+        ("wi_detect_defects", ctypes.c_int,
+         [_ptr, _ptr, _image_p, _image_p, _image_p]),
+        ("wi_analyze_defects", ctypes.c_int,
+         [_ptr, _image_p, ctypes.POINTER(_ptr)]),
+        ("wi_inspect", ctypes.c_int,
+         [_ptr, _ptr, _image_p, _image_p, _image_p, ctypes.POINTER(_ptr)]),
+        ("wi_inspect_batch", ctypes.c_int,
+         [_ptr, _ptr, _image_p, ctypes.c_size_t, ctypes.POINTER(_ptr)]),
+        ("wi_result_destroy", None, [_ptr]),
+        ("wi_result_pass", ctypes.c_int, [_ptr]),
+        ("wi_result_ratio", ctypes.c_double, [_ptr]),
+        ("wi_result_defect_count", ctypes.c_size_t, [_ptr]),
+        ("wi_result_defects", ctypes.c_size_t,
+         [_ptr, ctypes.c_void_p, ctypes.c_size_t])):
+    fn = getattr(_lib, name)
+    fn.restype = restype
+    fn.argtypes = argtypes
+
+if _lib.wi_abi_version() != ABI_VERSION:
+    raise WaferInspectError("wafer_inspect ABI %d, bindings expect %d"
+                            % (_lib.wi_abi_version(), ABI_VERSION))
+
+
+def _check(status):
+    if status != 0:
+        raise WaferInspectError(_lib.wi_last_error().decode())
+
+
+def _as_image(array, writable=False):
+    """Describes ARRAY to the library without copying it.
+
+    Rows may be padded (a slice of a larger array), but pixels within a
+    row must be packed.  Read-only inputs that are not are copied once;
+    outputs must already be in that layout.
+    """
+    if array.dtype != np.uint8:
+        raise TypeError("images must be uint8")
+
+    if array.ndim == 2:
+        fmt, channels = FORMAT_GRAY8, 1
+    elif array.ndim == 3 and array.shape[2] in (3, 4):
+        fmt = FORMAT_BGR24 if array.shape[2] == 3 else FORMAT_BGRA32
+        channels = array.shape[2]
+    else:
+        raise ValueError("expected HxW, HxWx3 or HxWx4, got %r"
+                         % (array.shape,))
+
+    packed = array.strides[1] == channels and (
+        array.ndim == 2 or array.strides[2] == 1) and array.strides[0] > 0
+    if not packed:
+        if writable:
+            raise ValueError("output arrays need packed pixels within rows")
+        array = np.ascontiguousarray(array)
+
+    image = _Image(array.ctypes.data, array.shape[1], array.shape[0],
+                   array.strides[0], fmt)
+    return image, array
+
+
+def _plane_out(out, like):
+    if out is None:
+        return np.empty(like.shape[:2], np.uint8)
+    if out.shape != like.shape[:2] or out.dtype != np.uint8:
+        raise ValueError("output must be a uint8 array of shape %r"
+                         % (like.shape[:2],))
+    if not out.flags.writeable:
+        raise ValueError("output array is read-only")
+    return out
+
+
+class Context:
+    """Library state shared by calls.  THREADS > 0 sets OpenCV's thread
+    count for the whole process, not just this context."""
+
+    def __init__(self, threads=0):
+        self._handle = _lib.wi_context_create(threads)
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.wi_context_destroy(self._handle)
+            self._handle = None
+
+
+_default_context = None
+
+
+def _context(ctx):
+    global _default_context
+    if ctx is not None:
+        return ctx._handle
+    if _default_context is None:
+        _default_context = Context()
+    return _default_context._handle
+
+
+class Recipe:
+    """Inspection parameters, set by the field names the C ABI accepts.
+
+    Recipe(threshold=12, detect_dark=1, tophat_scales=[5, 9, 15])
+    """
+
+    def __init__(self, **fields):
+        self._handle = _lib.wi_recipe_create()
+        for key, value in fields.items():
+            self[key] = value
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.wi_recipe_destroy(self._handle)
+            self._handle = None
+
+    def __setitem__(self, key, value):
+        if key == "tophat_scales":
+            scales = (ctypes.c_int * len(value))(*value)
+            _check(_lib.wi_recipe_set_tophat_scales(self._handle, scales,
+                                                    len(value)))
+            return
+        _check(_lib.wi_recipe_set(self._handle, key.encode(), float(value)))
+
+    def __getitem__(self, key):
+        value = ctypes.c_double()
+        _check(_lib.wi_recipe_get(self._handle, key.encode(),
+                                  ctypes.byref(value)))
+        return value.value
+
+
+class Result:
+    """Verdict and defect table of one inspection.
+
+    The result owns its library handle until it is collected.  The
+    defect count is always cheap; the table itself is fetched on the
+    first access to DEFECTS, so batch results whose defects are never
+    read are never analyzed.
+    """
+
+    def __init__(self, handle):
+        self._handle = handle.value if isinstance(handle, _ptr) else handle
+        self._defects = None
+        self.passed = bool(_lib.wi_result_pass(self._handle))
+        self.ratio = _lib.wi_result_ratio(self._handle)
+        self.defect_count = _lib.wi_result_defect_count(self._handle)
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.wi_result_destroy(self._handle)
+            self._handle = None
+
+    @property
+    def defects(self):
+        """The defect table as a DEFECT_DTYPE structured array."""
+        if self._defects is None:
+            self._defects = _defect_table(self._handle, self.defect_count)
+        return self._defects
+
+    def __repr__(self):
+        return "Result(passed=%s, ratio=%.6g, defects=%d)" % (
+            self.passed, self.ratio, self.defect_count)
+
+
+def _defect_table(handle, count):
+    defects = np.empty(count, DEFECT_DTYPE)
+    if count:
+        copied = _lib.wi_result_defects(handle, defects.ctypes.data, count)
+        if copied == 0:
+            error = _lib.wi_last_error().decode()
+            if error:
+                raise WaferInspectError(error)
+        defects = defects[:copied]
+    return defects
+
+
+def extract_lens_mask(gray, out=None, ctx=None):
+    src, gray = _as_image(gray)
+    out = _plane_out(out, gray)
+    dst, _ = _as_image(out, writable=True)
+    _check(_lib.wi_extract_lens_mask(_context(ctx), src, dst))
+    return out
+
+
+def correct_illumination(gray, mask, recipe, out=None, ctx=None):
+    src, gray = _as_image(gray)
+    msk, mask = _as_image(mask)
+    out = _plane_out(out, gray)
+    dst, _ = _as_image(out, writable=True)
+    _check(_lib.wi_correct_illumination(_context(ctx), recipe._handle,
+                                        src, msk, dst))
+    return out
+
+
+def detect_defects(corrected, mask, recipe, out=None, ctx=None):
+    src, corrected = _as_image(corrected)
+    msk, mask = _as_image(mask)
+    out = _plane_out(out, corrected)
+    dst, _ = _as_image(out, writable=True)
+    _check(_lib.wi_detect_defects(_context(ctx), recipe._handle,
+                                  src, msk, dst))
+    return out
+
+
+def analyze_defects(defect_mask, ctx=None):
+    """Returns the defect table as a DEFECT_DTYPE structured array."""
+    src, defect_mask = _as_image(defect_mask)
+    handle = _ptr()
+    _check(_lib.wi_analyze_defects(_context(ctx), src, ctypes.byref(handle)))
+    return Result(handle).defects
+
+
+def inspect(image, recipe, corrected=None, defect_mask=None, ctx=None):
+    """Full pipeline on a grey, BGR or BGRA image.  When given, CORRECTED
+    and DEFECT_MASK receive the intermediate images in place."""
+    src, image = _as_image(image)
+    outs = []
+    for out in (corrected, defect_mask):
+        if out is None:
+            outs.append(None)
+        else:
+            dst, _ = _as_image(_plane_out(out, image), writable=True)
+            outs.append(ctypes.byref(dst))
+    handle = _ptr()
+    _check(_lib.wi_inspect(_context(ctx), recipe._handle, src,
+                           outs[0], outs[1], ctypes.byref(handle)))
+    return Result(handle)
+
+
+def inspect_batch(images, recipe, ctx=None):
+    """Inspects a sequence of images in one library call, returning the
+    results in input order."""
+    views = [_as_image(image) for image in images]
+    inputs = (_Image * len(views))(*(view for view, _ in views))
+    handles = (_ptr * len(views))()
+    status = _lib.wi_inspect_batch(_context(ctx), recipe._handle, inputs,
+                                   len(views), handles)
+    if status != 0:
+        for handle in handles:
+            if handle:
+                _lib.wi_result_destroy(handle)
+        _check(status)
+    return [Result(handle) for handle in handles]
@@ -0,0 +1,234 @@
+#include "autotune.h"
+#include "morphology.h"
+#include <cfloat>
+#include <functional>
+#include <map>
+
+struct TunedVariants
+{
+  int decimated_blur = 0;
+  int banded_tophat = 0;
+  int ccl_algorithm = cv::CCL_DEFAULT;
+};
+
+cv::Mat
+make_synthetic_wafer (cv::Size size)
+{
+  cv::Mat wafer = cv::Mat::zeros (size, CV_32F);
+  cv::Point2f c (size.width * 0.5f, size.height * 0.5f);
+  float radius = 0.45f * std::min (size.width, size.height);
+
+  for (int y = 0; y < size.height; y++)
+    {
+      float* row = wafer.ptr<float> (y);
+      for (int x = 0; x < size.width; x++)
+        {
+          float dx = (x - c.x) / radius;
+          float dy = (y - c.y) / radius;
+          float r2 = dx * dx + dy * dy;
+          if (r2 <= 1.0f)
+            row[x] = 150.0f * (1.0f - 0.3f * r2) + 20.0f * dx;
+        }
+    }
+
+  cv::RNG rng (0x5eed);
+  cv::Mat noise (size, CV_32F);
+  rng.fill (noise, cv::RNG::NORMAL, 0.0, 4.0);
+  cv::Mat lens = (wafer > 0);
+  cv::add (wafer, noise, wafer, lens);
+
+  cv::Mat gray;
+  wafer.convertTo (gray, CV_8U);
+
+  for (int i = 0; i < 24; i++)
+    {
+      float a = rng.uniform (0.0f, (float)CV_2PI);
+      float r = rng.uniform (0.0f, 0.9f * radius);
+      cv::Point p (cvRound (c.x + r * std::cos (a)),
+                   cvRound (c.y + r * std::sin (a)));
+      cv::circle (gray, p, rng.uniform (1, 4), 230, cv::FILLED);
+    }
+
+  cv::line (gray, c - cv::Point2f (0.3f * radius, 0.1f * radius),
+            c + cv::Point2f (0.4f * radius, 0.05f * radius), 220, 2);
+
+  return gray;
+}
+
+static double
+best_time_ms (const std::function<void ()>& fn, int reps = 3)
+{
+  double best = DBL_MAX;
+  for (int i = 0; i < reps; i++)
+    {
+      int64 t0 = cv::getTickCount ();
+      fn ();
+      double ms = (cv::getTickCount () - t0) * 1000.0 / cv::getTickFrequency ();
+      best = std::min (best, ms);
+    }
+  return best;
+}
+
+/* FNV-1a, stable across builds unlike std::hash.  */
+static uint64
+fnv1a (const std::string& s)
+{
+  uint64 h = 1469598103934665603ULL;
+  for (unsigned char ch : s)
+    {
+      h ^= ch;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+/* The machine, the image shape and the recipe fields that change how
+   the variants rank: the blur size, the top-hat scales and polarity,
+   and the threshold, which sets how many components labeling sees.  */
+static std::string
+tune_key (cv::Size size, const Recipe& recipe)
+{
+  uint64 cpu = fnv1a (cv::getCPUFeaturesLine ());
+
+  std::vector<int> scales = recipe.detect.tophat_scales;
+  std::sort (scales.begin (), scales.end ());
+  std::string scale_list;
+  for (int s : scales)
+    scale_list += (scale_list.empty () ? "" : "-") + std::to_string (s);
+
+  return cv::format ("m%08x_c%d_t%d_%dx%d_b%d_s%s_d%d_th%d",
+                     (unsigned)(cpu ^ (cpu >> 32)),
+                     cv::getNumberOfCPUs (), cv::getNumThreads (),
+                     size.width, size.height,
+                     recipe.illumination.blur_size, scale_list.c_str (),
+                     (int)recipe.detect.detect_dark,
+                     recipe.detect.threshold);
+}
+
+static std::map<std::string, TunedVariants>
+load_tuning (const std::string& path)
+{
+  std::map<std::string, TunedVariants> entries;
+
+  cv::FileStorage fs;
+  try
+    {
+      if (!fs.open (path, cv::FileStorage::READ))
+        return entries;
+    }
+  catch (const cv::Exception&)
+    {
+      return entries;
+    }
+
+  for (const auto& node : fs["tuned"])
+    {
+      TunedVariants v;
+      std::string key = (std::string)node["key"];
+      node["decimated_blur"] >> v.decimated_blur;
+      node["banded_tophat"] >> v.banded_tophat;
+      node["ccl_algorithm"] >> v.ccl_algorithm;
+      entries[key] = v;
+    }
+
+  return entries;
+}
+
+static void
+save_tuning (const std::string& path,
+             const std::map<std::string, TunedVariants>& entries)
+{
+  cv::FileStorage fs (path, cv::FileStorage::WRITE);
+  if (!fs.isOpened ())
+    return;
+
+  fs << "tuned" << "[";
+  for (const auto& e : entries)
+    fs << "{" << "key" << e.first
+       << "decimated_blur" << e.second.decimated_blur
+       << "banded_tophat" << e.second.banded_tophat
+       << "ccl_algorithm" << e.second.ccl_algorithm << "}";
+  fs << "]";
+}
+
+static TunedVariants
+benchmark_variants (cv::Size size, const Recipe& recipe)
+{
+  TunedVariants best;
+
+  cv::Mat gray = make_synthetic_wafer (size);
+  cv::Mat mask = extract_lens_mask (gray);
+
+  /* Blur: the decimated variant is an approximation, so it must also
+     stay within one grey level of the direct one on average.  */
+  IlluminationParams illum = recipe.illumination;
+  illum.estimator = BackgroundEstimator::gaussian;
+  cv::Mat direct, decimated;
+
+  illum.decimated_blur = false;
+  double t_direct = best_time_ms ([&] {
+    direct = correct_illumination (gray, mask, illum);
+  });
+  illum.decimated_blur = true;
+  double t_decimated = best_time_ms ([&] {
+    decimated = correct_illumination (gray, mask, illum);
+  });
+
+  cv::Mat diff;
+  cv::absdiff (direct, decimated, diff);
+  bool close_enough = (cv::mean (diff, mask)[0] <= 1.0);
+  best.decimated_blur = (t_decimated < t_direct && close_enough);
+
+  /* Top-hat: both variants are exact.  */
+  DetectParams detect = recipe.detect;
+  cv::Mat defect_mask;
+
+  detect.banded_tophat = false;
+  double t_whole = best_time_ms ([&] {
+    defect_mask = detect_defects (direct, mask, detect);
+  });
+  detect.banded_tophat = true;
+  double t_banded = best_time_ms ([&] {
+    detect_defects (direct, mask, detect);
+  });
+  best.banded_tophat = (t_banded < t_whole);
+
+  /* Labeling: all algorithms give identical labels.  */
+  const int algorithms[] = { cv::CCL_SAUF, cv::CCL_BBDT, cv::CCL_SPAGHETTI };
+  double t_best = DBL_MAX;
+  for (int algorithm : algorithms)
+    {
+      double t = best_time_ms ([&] {
+        cv::Mat opened = defect_mask.clone ();
+        area_open (opened, detect.min_area, algorithm);
+      });
+      if (t < t_best)
+        {
+          t_best = t;
+          best.ccl_algorithm = algorithm;
+        }
+    }
+
+  return best;
+}
+
+bool
+autotune (cv::Size size, Recipe& recipe, const std::string& cache_path)
+{
+  auto entries = load_tuning (cache_path);
+  std::string key = tune_key (size, recipe);
+
+  bool cached = (entries.count (key) != 0);
+  if (!cached)
+    {
+      entries[key] = benchmark_variants (size, recipe);
+      save_tuning (cache_path, entries);
+    }
+
+  const TunedVariants& v = entries[key];
+  recipe.illumination.decimated_blur = (v.decimated_blur != 0);
+  recipe.detect.banded_tophat = (v.banded_tophat != 0);
+  recipe.detect.ccl_algorithm = v.ccl_algorithm;
+
+  return cached;
+}
\ No newline at end of file
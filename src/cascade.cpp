@@ -0,0 +1,106 @@
+#include "cascade.h"
+
+static double
+elapsed_ms (int64 since)
+{
+  return (cv::getTickCount () - since) * 1000.0 / cv::getTickFrequency ();
+}
+
+/* RECIPE rescaled for an image DECIMATION times smaller.  Shrunk defects
+   lose contrast to area averaging, hence the lower threshold, and a
+   defect may be a single pixel, hence no area opening.  CLAHE_TILES is
+   a tile count, not a size, so it is kept: the tiles shrink with the
+   image.  */
+static Recipe
+screen_recipe (const Recipe& recipe, const CascadeParams& params)
+{
+  int f = params.decimation;
+
+  Recipe screen = recipe;
+  screen.illumination.blur_size
+    = std::max (recipe.illumination.blur_size / f, 3) | 1;
+  screen.illumination.decimated_blur = false;
+  screen.illumination.median_downsample = 1;
+
+  screen.detect.threshold = params.screen_threshold;
+  screen.detect.min_area = 1;
+  for (int& s : screen.detect.tophat_scales)
+    s = std::max (s / f, 3) | 1;
+
+  return screen;
+}
+
+bool
+screen_wafer (const cv::Mat& gray, const Recipe& recipe,
+              const CascadeParams& params)
+{
+  CV_Assert (params.decimation >= 1);
+
+  cv::Mat small;
+  if (params.decimation > 1)
+    cv::resize (gray, small, {}, 1.0 / params.decimation,
+                1.0 / params.decimation, cv::INTER_AREA);
+  else
+    small = gray;
+
+  Recipe screen = screen_recipe (recipe, params);
+
+  cv::Mat mask = extract_lens_mask (small);
+  cv::Mat corrected, defect_mask;
+  correct_illumination (small, mask, screen.illumination, corrected);
+  detect_defects (corrected, mask, screen.detect, defect_mask);
+
+  /* Both areas in full-resolution pixels: each screen pixel stands for
+     DECIMATION squared of them.  */
+  double f2 = (double)params.decimation * params.decimation;
+  double defect_area = cv::countNonZero (defect_mask) * f2;
+  double lens_area = cv::countNonZero (mask) * f2;
+  return defect_area > 0
+         && defect_area >= params.screen_margin * recipe.pass_ratio
+                           * lens_area;
+}
+
+CascadeResult
+inspect_cascade (const cv::Mat& gray, const Recipe& recipe,
+                 const CascadeParams& params, CascadeStats& stats,
+                 cv::RNG& rng)
+{
+  CascadeResult result;
+
+  int64 t0 = cv::getTickCount ();
+  result.suspect = screen_wafer (gray, recipe, params);
+  stats.screen_ms += elapsed_ms (t0);
+  stats.screened++;
+
+  if (result.suspect)
+    stats.flagged++;
+  else
+    result.audited = rng.uniform (0.0, 1.0) < params.audit_rate;
+
+  if (!result.suspect && !result.audited)
+    return result;
+
+  int64 t1 = cv::getTickCount ();
+  result.full = true;
+  inspect_into (gray, recipe, result.inspection);
+  const InspectionResult& r = result.inspection;
+  result.display = build_annotated_display (r.corrected, r.mask,
+                                            r.all_defects (), r.pass,
+                                            r.ratio);
+  stats.full_ms += elapsed_ms (t1);
+
+  if (result.audited)
+    {
+      stats.audited++;
+      if (!r.pass)
+        stats.misses++;
+    }
+
+  return result;
+}
+
+double
+estimated_miss_rate (const CascadeStats& stats)
+{
+  return stats.audited ? (double)stats.misses / stats.audited : 0.0;
+}
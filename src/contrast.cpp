@@ -0,0 +1,329 @@
+#include "contrast.h"
+#include <cstdint>
+#include <cstring>
+
+/* True when no byte of W is zero.  */
+static inline bool
+all_bytes_set (uint64_t w)
+{
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t highs = 0x8080808080808080ull;
+  return ((w - ones) & ~w & highs) == 0;
+}
+
+/* Four interleaved sub-histograms break the store-to-load dependency
+   between runs of equal pixels, which is what limits a plain byte
+   histogram loop.  The mask is tested eight pixels at a time as one
+   word: runs wholly outside the lens are skipped and runs wholly inside
+   are counted without reading the mask per pixel, so only pixels on
+   the lens edge take the masked path.  */
+static int
+masked_histogram (const cv::Mat& src, const cv::Mat& mask, cv::Rect roi,
+                  int hist[256])
+{
+  int sub[4][256] = {};
+  int count = 0;
+
+  for (int y = roi.y; y < roi.y + roi.height; y++)
+    {
+      const uchar* s = src.ptr<uchar> (y) + roi.x;
+      const uchar* m = mask.ptr<uchar> (y) + roi.x;
+      int x = 0;
+
+      for (; x + 8 <= roi.width; x += 8)
+        {
+          uint64_t w;
+          std::memcpy (&w, m + x, sizeof w);
+          if (w == 0)
+            continue;
+
+          const uchar* p = s + x;
+          if (all_bytes_set (w))
+            {
+              sub[0][p[0]]++;
+              sub[1][p[1]]++;
+              sub[2][p[2]]++;
+              sub[3][p[3]]++;
+              sub[0][p[4]]++;
+              sub[1][p[5]]++;
+              sub[2][p[6]]++;
+              sub[3][p[7]]++;
+              continue;
+            }
+
+          for (int i = 0; i < 8; i++)
+            sub[i & 3][p[i]] += (m[x + i] != 0);
+        }
+      for (; x < roi.width; x++)
+        sub[0][s[x]] += (m[x] != 0);
+    }
+
+  for (int i = 0; i < 256; i++)
+    {
+      hist[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+      count += hist[i];
+    }
+
+  return count;
+}
+
+/* Clip, redistribute and integrate exactly as cv::CLAHE does, but
+   against the in-mask pixel count instead of the tile area.  */
+static void
+build_clahe_lut (int hist[256], int count, double clip_limit, uchar* lut)
+{
+  int clip = std::max (1, (int)(clip_limit * count / 256));
+
+  int excess = 0;
+  for (int i = 0; i < 256; i++)
+    if (hist[i] > clip)
+      {
+        excess += hist[i] - clip;
+        hist[i] = clip;
+      }
+
+  int batch = excess / 256;
+  int residual = excess - batch * 256;
+  for (int i = 0; i < 256; i++)
+    hist[i] += batch;
+
+  if (residual != 0)
+    {
+      int step = std::max (256 / residual, 1);
+      for (int i = 0; i < 256 && residual > 0; i += step, residual--)
+        hist[i]++;
+    }
+
+  float scale = 255.0f / count;
+  int sum = 0;
+  for (int i = 0; i < 256; i++)
+    {
+      sum += hist[i];
+      lut[i] = cv::saturate_cast<uchar> (sum * scale);
+    }
+}
+
+cv::Mat
+masked_clahe (const cv::Mat& src, const cv::Mat& mask, double clip_limit,
+              cv::Size tiles)
+{
+  CV_Assert (src.type () == CV_8U && mask.type () == CV_8U);
+  CV_Assert (src.size () == mask.size ());
+
+  int tile_w = (src.cols + tiles.width - 1) / tiles.width;
+  int tile_h = (src.rows + tiles.height - 1) / tiles.height;
+  int n_tiles = tiles.area ();
+
+  cv::Mat luts (n_tiles, 256, CV_8U);
+  std::vector<uchar> used (n_tiles, 0);
+
+  cv::parallel_for_ (cv::Range (0, n_tiles), [&] (const cv::Range& range)
+    {
+      for (int t = range.start; t < range.end; t++)
+        {
+          int tx = t % tiles.width;
+          int ty = t / tiles.width;
+          cv::Rect roi = cv::Rect (tx * tile_w, ty * tile_h, tile_w, tile_h)
+                         & cv::Rect (0, 0, src.cols, src.rows);
+          if (roi.empty ())
+            continue;
+
+          /* Most out-of-lens tiles are rejected here without touching
+             the source image.  */
+          if (cv::countNonZero (mask (roi)) == 0)
+            continue;
+
+          int hist[256];
+          int count = masked_histogram (src, mask, roi, hist);
+          build_clahe_lut (hist, count, clip_limit, luts.ptr<uchar> (t));
+          used[t] = 1;
+        }
+    });
+
+  /* Per-column neighbour tiles and weights, shared by every row.  */
+  std::vector<int> tx1 (src.cols), tx2 (src.cols);
+  std::vector<float> xa (src.cols);
+  for (int x = 0; x < src.cols; x++)
+    {
+      float txf = (x + 0.5f) / tile_w - 0.5f;
+      int t1 = cvFloor (txf);
+      xa[x] = txf - t1;
+      tx1[x] = std::max (t1, 0);
+      tx2[x] = std::min (t1 + 1, tiles.width - 1);
+    }
+
+  cv::Mat dst = cv::Mat::zeros (src.size (), CV_8U);
+  cv::parallel_for_ (cv::Range (0, src.rows), [&] (const cv::Range& range)
+    {
+      for (int y = range.start; y < range.end; y++)
+        {
+          float tyf = (y + 0.5f) / tile_h - 0.5f;
+          int ty1 = cvFloor (tyf);
+          float ya = tyf - ty1;
+          int ty2 = std::min (ty1 + 1, tiles.height - 1);
+          ty1 = std::max (ty1, 0);
+
+          const uchar* s = src.ptr<uchar> (y);
+          const uchar* m = mask.ptr<uchar> (y);
+          uchar* d = dst.ptr<uchar> (y);
+
+          for (int x = 0; x < src.cols; x++)
+            {
+              if (!m[x])
+                continue;
+
+              int t[4] = { ty1 * tiles.width + tx1[x],
+                           ty1 * tiles.width + tx2[x],
+                           ty2 * tiles.width + tx1[x],
+                           ty2 * tiles.width + tx2[x] };
+              float w[4] = { (1.0f - xa[x]) * (1.0f - ya),
+                             xa[x] * (1.0f - ya),
+                             (1.0f - xa[x]) * ya,
+                             xa[x] * ya };
+
+              /* Empty neighbours drop out and the rest are renormalised.
+                 The pixel's own tile is never empty.  */
+              float acc = 0.0f;
+              float norm = 0.0f;
+              for (int k = 0; k < 4; k++)
+                if (used[t[k]])
+                  {
+                    acc += w[k] * luts.at<uchar> (t[k], s[x]);
+                    norm += w[k];
+                  }
+
+              d[x] = cv::saturate_cast<uchar> (acc / std::max (norm, 1e-6f));
+            }
+        }
+    });
+
+  return dst;
+}
+
+/* Ratio histogram: 2048 bins per unit over [0, 4).  Illumination ratios
+   sit near 1, so this resolves far finer than one output grey level.  */
+static const int RATIO_BINS_PER_UNIT = 2048;
+static const int RATIO_BINS = 4 * RATIO_BINS_PER_UNIT;
+
+/* Ratio value below which PCT percent of the histogram lies,
+   interpolated linearly inside the bin.  */
+static float
+histogram_percentile (const std::vector<int64>& hist, int64 total, float pct)
+{
+  double target = total * (double)pct / 100.0;
+  int64 sum = 0;
+
+  for (int i = 0; i < (int)hist.size (); i++)
+    {
+      if (hist[i] > 0 && sum + hist[i] >= target)
+        {
+          double frac = (target - sum) / (double)hist[i];
+          return (float)((i + frac) / RATIO_BINS_PER_UNIT);
+        }
+      sum += hist[i];
+    }
+
+  return (float)hist.size () / RATIO_BINS_PER_UNIT;
+}
+
+/* MAKE_ROW (y) returns a callable mapping a column to that pixel's
+   ratio, so both passes share one definition of the ratio.  */
+template <typename MakeRow>
+static void
+stretch_percentile (const cv::Mat& mask, float low, float high,
+                    MakeRow make_row, cv::Mat& dst)
+{
+  int stripes = std::max (1, std::min (cv::getNumThreads (), mask.rows));
+  std::vector<std::vector<int64>> partial (stripes,
+                                           std::vector<int64> (RATIO_BINS));
+
+  cv::parallel_for_ (cv::Range (0, stripes), [&] (const cv::Range& range)
+    {
+      for (int s = range.start; s < range.end; s++)
+        {
+          auto& hist = partial[s];
+          int y0 = s * mask.rows / stripes;
+          int y1 = (s + 1) * mask.rows / stripes;
+
+          for (int y = y0; y < y1; y++)
+            {
+              auto ratio = make_row (y);
+              const uchar* m = mask.ptr<uchar> (y);
+              for (int x = 0; x < mask.cols; x++)
+                {
+                  if (!m[x])
+                    continue;
+                  int bin = (int)(ratio (x) * RATIO_BINS_PER_UNIT);
+                  hist[std::min (std::max (bin, 0), RATIO_BINS - 1)]++;
+                }
+            }
+        }
+    });
+
+  std::vector<int64> hist (RATIO_BINS, 0);
+  int64 total = 0;
+  for (const auto& p : partial)
+    for (int i = 0; i < RATIO_BINS; i++)
+      {
+        hist[i] += p[i];
+        total += p[i];
+      }
+
+  dst.create (mask.size (), CV_8U);
+  dst.setTo (0);
+  if (total == 0)
+    return;
+
+  float lo = histogram_percentile (hist, total, low);
+  float hi = histogram_percentile (hist, total, high);
+  float scale = 255.0f / std::max (hi - lo, 1e-6f);
+
+  cv::parallel_for_ (cv::Range (0, mask.rows), [&] (const cv::Range& range)
+    {
+      for (int y = range.start; y < range.end; y++)
+        {
+          auto ratio = make_row (y);
+          const uchar* m = mask.ptr<uchar> (y);
+          uchar* d = dst.ptr<uchar> (y);
+          for (int x = 0; x < mask.cols; x++)
+            if (m[x])
+              d[x] = cv::saturate_cast<uchar> ((ratio (x) - lo) * scale);
+        }
+    });
+}
+
+void
+stretch_ratio_percentile (const cv::Mat& num, const cv::Mat& den,
+                          const cv::Mat& mask, float low, float high,
+                          cv::Mat& dst)
+{
+  CV_Assert (num.type () == CV_32F && den.type () == CV_32F);
+  CV_Assert (mask.type () == CV_8U && num.size () == mask.size ());
+
+  auto make_row = [&] (int y)
+    {
+      const float* a = num.ptr<float> (y);
+      const float* b = den.ptr<float> (y);
+      return [a, b] (int x) { return (a[x] + 1.0f) / (b[x] + 1.0f); };
+    };
+
+  stretch_percentile (mask, low, high, make_row, dst);
+}
+
+void
+stretch_gain_percentile (const cv::Mat& gray, const cv::Mat& gain,
+                         const cv::Mat& mask, float low, float high,
+                         cv::Mat& dst)
+{
+  CV_Assert (gray.type () == CV_8U && gain.type () == CV_32F);
+  CV_Assert (mask.type () == CV_8U && gray.size () == mask.size ());
+
+  auto make_row = [&] (int y)
+    {
+      const uchar* g = gray.ptr<uchar> (y);
+      const float* k = gain.ptr<float> (y);
+      return [g, k] (int x) { return (g[x] + 1.0f) * k[x]; };
+    };
+
+  stretch_percentile (mask, low, high, make_row, dst);
+}
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include "defect_processing.h"
+#include "contrast.h"
+#include "morphology.h"
+#include <cstring>
 
 cv::Mat
 extract_lens_mask (const cv::Mat& gray)
@@ -36,93 +39,566 @@ extract_lens_mask (const cv::Mat& gray)
   return clean_mask;
 }
 
-cv::Mat
-correct_illumination (const cv::Mat& gray,
-                      const cv::Mat& mask,
-                      int blur_size)
+static cv::Mat
+estimate_background (const cv::Mat& gray,
+                     const cv::Mat& float_gray,
+                     const cv::Mat& mask,
+                     const IlluminationParams& params)
 {
+  if (params.estimator == BackgroundEstimator::polynomial)
+    return fit_polynomial_background (float_gray, mask, params.poly_degree);
+
+  if (params.estimator == BackgroundEstimator::median)
+    return median_background (gray, mask, params.blur_size,
+                              params.median_downsample);
+
+  int blur_size = params.blur_size;
   if (blur_size % 2 == 0)
     blur_size++;
 
+  cv::Mat background;
+  if (!params.decimated_blur)
+    {
+      cv::GaussianBlur (float_gray, background, { blur_size, blur_size }, 0);
+      return background;
+    }
+
+  /* A wide Gaussian has almost no energy above the decimated Nyquist
+     rate, so blurring a copy decimated until the kernel is ~32 px wide
+     and interpolating back is visually indistinguishable.  */
+  int factor = 1;
+  while (blur_size / (factor * 2) >= 32)
+    factor *= 2;
+
+  cv::Mat small;
+  cv::resize (float_gray, small, {}, 1.0 / factor, 1.0 / factor,
+              cv::INTER_AREA);
+  /* The sigma GaussianBlur would derive from the full kernel size.  */
+  double sigma = 0.3 * ((blur_size - 1) * 0.5 - 1) + 0.8;
+  int small_size = (blur_size / factor) | 1;
+  cv::GaussianBlur (small, small, { small_size, small_size },
+                    sigma / factor);
+  cv::resize (small, background, float_gray.size (), 0, 0, cv::INTER_LINEAR);
+
+  return background;
+}
+
+void
+correct_illumination (const cv::Mat& gray,
+                      const cv::Mat& mask,
+                      const IlluminationParams& params,
+                      cv::Mat& corrected)
+{
   cv::Mat float_gray;
   gray.convertTo (float_gray, CV_32F);
 
-  cv::Mat background;
-  cv::GaussianBlur (float_gray, background, { blur_size, blur_size }, 0);
+  if (params.normalization == Normalization::percentile)
+    {
+      cv::Mat background = estimate_background (gray, float_gray, mask,
+                                                  params);
+      stretch_ratio_percentile (float_gray, background, mask,
+                                params.low_percentile,
+                                params.high_percentile, corrected);
+      return;
+    }
 
+  /* A polynomial surface is evaluated inside the divide rather than
+     written out and read back.  */
+  cv::Mat ratio;
+  if (params.estimator == BackgroundEstimator::polynomial)
+    polynomial_flat_field (float_gray, mask, params.poly_degree, ratio);
+  else
+    {
+      cv::Mat background = estimate_background (gray, float_gray, mask,
+                                                  params);
+      cv::divide (float_gray + 1.0f, background + 1.0f, ratio);
+    }
+
+  corrected.create (gray.size (), CV_8U);
+  corrected.setTo (0);
+  cv::normalize (ratio, corrected, 0, 255, cv::NORM_MINMAX, CV_8U, mask);
+}
+
+cv::Mat
+correct_illumination (const cv::Mat& gray,
+                      const cv::Mat& mask,
+                      const IlluminationParams& params)
+{
   cv::Mat corrected;
-  cv::divide (float_gray + 1.0f, background + 1.0f, corrected);
-  cv::normalize (corrected, corrected, 0, 255, cv::NORM_MINMAX, CV_8U, mask);
+  correct_illumination (gray, mask, params, corrected);
 
   return corrected;
 }
 
 cv::Mat
+correct_illumination (const cv::Mat& gray,
+                      const cv::Mat& mask,
+                      int blur_size)
+{
+  IlluminationParams params;
+  params.blur_size = blur_size;
+
+  return correct_illumination (gray, mask, params);
+}
+
+cv::Mat
+correct_illumination (const cv::Mat& gray,
+                      const cv::Mat& mask,
+                      const BackgroundModel& model,
+                      const IlluminationParams& params,
+                      FlatFieldReport* report)
+{
+  CV_Assert (gray.type () == CV_8U && gray.size () == model.gain.size ());
+
+  if (report)
+    *report = check_background_drift (gray, mask, model);
+
+  cv::Mat corrected;
+  if (params.normalization == Normalization::percentile)
+    {
+      stretch_gain_percentile (gray, model.gain, mask, params.low_percentile,
+                               params.high_percentile, corrected);
+      return corrected;
+    }
+
+  cv::Mat ratio (gray.size (), CV_32F);
+  cv::parallel_for_ (cv::Range (0, gray.rows), [&] (const cv::Range& range)
+    {
+      for (int y = range.start; y < range.end; y++)
+        {
+          const uchar* g = gray.ptr<uchar> (y);
+          const float* k = model.gain.ptr<float> (y);
+          float* d = ratio.ptr<float> (y);
+          for (int x = 0; x < gray.cols; x++)
+            d[x] = (g[x] + 1.0f) * k[x];
+        }
+    });
+
+  corrected = cv::Mat::zeros (gray.size (), CV_8U);
+  cv::normalize (ratio, corrected, 0, 255, cv::NORM_MINMAX, CV_8U, mask);
+
+  return corrected;
+}
+
+/* CLAHE and the white top-hat bank, plus the black one from the same
+   pass when the parameters ask for dark defects.  */
+static void
+tophat_responses (const cv::Mat& corrected,
+                  const cv::Mat& mask,
+                  const DetectParams& params,
+                  cv::Mat& white,
+                  cv::Mat& black)
+{
+  cv::Mat enhanced;
+  if (params.masked_clahe)
+    enhanced = masked_clahe (corrected, mask, params.clahe_clip,
+                             params.clahe_tiles);
+  else
+    {
+      auto clahe = cv::createCLAHE (params.clahe_clip, params.clahe_tiles);
+      clahe->apply (corrected, enhanced);
+    }
+
+  std::vector<int> scales = params.tophat_scales;
+  std::sort (scales.begin (), scales.end ());
+
+  if (params.detect_dark)
+    tophat_bank (enhanced, scales, white, black);
+  else
+    white = tophat_bank (enhanced, scales, cv::MORPH_OPEN,
+                         params.banded_tophat);
+}
+
+/* Area opening of each polarity on its own, so a bright and a dark blob
+   that touch are kept or dropped, and later labelled, as two defects.  */
+static void
+open_polarities (cv::Mat& defect_mask, int min_area, int ccl_algorithm,
+                 bool dark)
+{
+  if (!dark)
+    {
+      area_open (defect_mask, min_area, ccl_algorithm);
+      return;
+    }
+
+  for (uchar value : { DEFECT_BRIGHT, DEFECT_DARK })
+    {
+      cv::Mat plane = (defect_mask == value);
+      cv::Mat kept = plane.clone ();
+      area_open (kept, min_area, ccl_algorithm);
+      defect_mask.setTo (0, plane != kept);
+    }
+}
+
+void
 detect_defects (const cv::Mat& corrected,
                 const cv::Mat& mask,
-                int threshold)
+                const DetectParams& params,
+                cv::Mat& defect_mask)
 {
-  cv::Mat enhanced;
-  auto clahe = cv::createCLAHE (3.0, { 8, 8 });
-  clahe->apply (corrected, enhanced);
+  cv::Mat tophat, black_tophat;
+  tophat_responses (corrected, mask, params, tophat, black_tophat);
 
-  cv::Mat tophat;
-  auto kernel = cv::getStructuringElement (cv::MORPH_ELLIPSE, { 7, 7 });
-  cv::morphologyEx (enhanced, tophat, cv::MORPH_TOPHAT, kernel);
+  if (!params.detect_dark)
+    {
+      cv::threshold (tophat, defect_mask, params.threshold, DEFECT_BRIGHT,
+                     cv::THRESH_BINARY);
+      cv::bitwise_and (defect_mask, mask, defect_mask);
+    }
+  else
+    {
+      /* Threshold both polarities and apply the lens mask in one pass;
+         bright wins where both respond.  */
+      defect_mask.create (tophat.size (), CV_8U);
+      int t = params.threshold;
+      cv::parallel_for_ (cv::Range (0, tophat.rows),
+                         [&] (const cv::Range& range)
+        {
+          for (int y = range.start; y < range.end; y++)
+            {
+              const uchar* white = tophat.ptr<uchar> (y);
+              const uchar* black = black_tophat.ptr<uchar> (y);
+              const uchar* m = mask.ptr<uchar> (y);
+              uchar* dst = defect_mask.ptr<uchar> (y);
+              for (int x = 0; x < tophat.cols; x++)
+                {
+                  uchar v = (white[x] > t) ? DEFECT_BRIGHT
+                            : (black[x] > t) ? DEFECT_DARK : 0;
+                  dst[x] = m[x] ? v : 0;
+                }
+            }
+        });
+    }
 
-  cv::Mat defect_mask;
-  cv::threshold (tophat, defect_mask, threshold, 255, cv::THRESH_BINARY);
+  open_polarities (defect_mask, params.min_area, params.ccl_algorithm,
+                   params.detect_dark);
+}
+
+std::vector<cv::Mat>
+detect_defects (const cv::Mat& corrected,
+                const cv::Mat& mask,
+                const std::vector<DetectParams>& variants)
+{
+  std::vector<cv::Mat> masks (variants.size ());
+  if (variants.empty ())
+    return masks;
+
+  const DetectParams& shared = variants[0];
+  cv::Mat tophat, black_tophat;
+  tophat_responses (corrected, mask, shared, tophat, black_tophat);
+
+  std::vector<int> thresholds;
+  for (const auto& v : variants)
+    thresholds.push_back (v.threshold);
+  std::sort (thresholds.begin (), thresholds.end ());
+  thresholds.erase (std::unique (thresholds.begin (), thresholds.end ()),
+                    thresholds.end ());
+
+  /* Each response pixel is read once and compared against every distinct
+     cut, so extra variants cost a store per pixel, not a top-hat.  */
+  int cuts = (int)thresholds.size ();
+  std::vector<cv::Mat> levels (cuts);
+  for (auto& l : levels)
+    l.create (tophat.size (), CV_8U);
+
+  bool dark = shared.detect_dark;
+  cv::parallel_for_ (cv::Range (0, tophat.rows), [&] (const cv::Range& range)
+    {
+      std::vector<uchar*> dst (cuts);
+      for (int y = range.start; y < range.end; y++)
+        {
+          const uchar* white = tophat.ptr<uchar> (y);
+          const uchar* black = dark ? black_tophat.ptr<uchar> (y) : nullptr;
+          const uchar* m = mask.ptr<uchar> (y);
+          for (int k = 0; k < cuts; k++)
+            dst[k] = levels[k].ptr<uchar> (y);
+
+          for (int x = 0; x < tophat.cols; x++)
+            {
+              uchar w = m[x] ? white[x] : 0;
+              uchar b = (m[x] && dark) ? black[x] : 0;
+              for (int k = 0; k < cuts; k++)
+                {
+                  int t = thresholds[k];
+                  dst[k][x] = (w > t) ? DEFECT_BRIGHT
+                              : (b > t) ? DEFECT_DARK : 0;
+                }
+            }
+        }
+    });
+
+  /* Area opening per distinct (threshold, min_area) cut.  */
+  for (size_t i = 0; i < variants.size (); i++)
+    {
+      for (size_t j = 0; j < i && masks[i].empty (); j++)
+        if (variants[j].threshold == variants[i].threshold
+            && variants[j].min_area == variants[i].min_area)
+          masks[i] = masks[j];
+      if (!masks[i].empty ())
+        continue;
+
+      int k = (int)(std::lower_bound (thresholds.begin (), thresholds.end (),
+                                      variants[i].threshold)
+                    - thresholds.begin ());
+      bool last_use = true;
+      for (size_t j = i + 1; j < variants.size (); j++)
+        if (variants[j].threshold == variants[i].threshold
+            && variants[j].min_area != variants[i].min_area)
+          last_use = false;
+
+      masks[i] = last_use ? levels[k] : levels[k].clone ();
+      open_polarities (masks[i], variants[i].min_area, shared.ccl_algorithm,
+                       dark);
+    }
+
+  return masks;
+}
+
+void
+detect_defects (const cv::Mat& corrected,
+                const cv::Mat& mask,
+                const DetectParams& params,
+                const std::vector<ZoneParams>& zones,
+                const ZoneMap& zone_map,
+                cv::Mat& defect_mask)
+{
+  CV_Assert (zone_map.size == corrected.size ());
 
-  auto noise_kernel = cv::getStructuringElement (cv::MORPH_ELLIPSE, { 3, 3 });
-  cv::morphologyEx (defect_mask, defect_mask, cv::MORPH_OPEN, noise_kernel);
+  cv::Mat tophat, black_tophat;
+  tophat_responses (corrected, mask, params, tophat, black_tophat);
 
-  cv::bitwise_and (defect_mask, mask, defect_mask);
+  defect_mask.create (tophat.size (), CV_8U);
+  bool dark = params.detect_dark;
+  cv::parallel_for_ (cv::Range (0, tophat.rows), [&] (const cv::Range& range)
+    {
+      for (int y = range.start; y < range.end; y++)
+        {
+          const uchar* white = tophat.ptr<uchar> (y);
+          const uchar* black = dark ? black_tophat.ptr<uchar> (y) : nullptr;
+          const uchar* m = mask.ptr<uchar> (y);
+          uchar* dst = defect_mask.ptr<uchar> (y);
+          std::memset (dst, 0, tophat.cols);
+
+          for (int i = zone_map.row_start[y]; i < zone_map.row_start[y + 1];
+               i++)
+            {
+              const ZoneSpan& span = zone_map.spans[i];
+              int t = zones[span.zone].threshold;
+              for (int x = span.x0; x <= span.x1; x++)
+                {
+                  uchar v = (white[x] > t) ? DEFECT_BRIGHT
+                            : (dark && black[x] > t) ? DEFECT_DARK : 0;
+                  dst[x] = m[x] ? v : 0;
+                }
+            }
+        }
+    });
+
+  open_polarities (defect_mask, params.min_area, params.ccl_algorithm,
+                   params.detect_dark);
+}
+
+cv::Mat
+detect_defects (const cv::Mat& corrected,
+                const cv::Mat& mask,
+                const DetectParams& params)
+{
+  cv::Mat defect_mask;
+  detect_defects (corrected, mask, params, defect_mask);
 
   return defect_mask;
 }
 
-std::vector<Defect>
-analyze_defects (const cv::Mat& defect_mask)
+cv::Mat
+detect_defects (const cv::Mat& corrected,
+                const cv::Mat& mask,
+                int threshold,
+                int min_area)
+{
+  DetectParams params;
+  params.threshold = threshold;
+  params.min_area = min_area;
+
+  return detect_defects (corrected, mask, params);
+}
+
+bool
+describe_defect (const std::vector<cv::Point>& contour, uchar mask_value,
+                 Defect& d)
+{
+  float area = (float)cv::contourArea (contour);
+  if (area < 2.0f)
+    return false;
+
+  d.area = area;
+  d.boundingBox = cv::boundingRect (contour);
+  d.outline = encode_chain (contour);
+  d.polarity = (mask_value == DEFECT_DARK) ? "dark" : "bright";
+
+  auto moments = cv::moments (contour);
+  d.center = { (float)(moments.m10 / moments.m00),
+               (float)(moments.m01 / moments.m00) };
+
+  float w = (float)d.boundingBox.width;
+  float h = (float)d.boundingBox.height;
+  d.ar = w / std::max<float> (h, 1.0f);
+
+  return true;
+}
+
+void
+classify_defect (Defect& d, const ClassifyParams& params)
+{
+  bool is_elongated = (d.ar > params.scratch_ar_high
+                       || d.ar <= params.scratch_ar_low);
+  bool is_large_enough = (d.area > params.scratch_min_area);
+
+  if (is_elongated && is_large_enough)
+    d.type = "scratch";
+  else if (d.area > params.cluster_min_area)
+    d.type = "cluster";
+  else
+    d.type = "speck";
+}
+
+void
+measure_scratch (const std::vector<cv::Point>& contour, Defect& d)
+{
+  const cv::Rect& box = d.boundingBox;
+
+  cv::Mat component = cv::Mat::zeros (box.size (), CV_8U);
+  std::vector<std::vector<cv::Point>> contours = { contour };
+  cv::drawContours (component, contours, 0, 255, cv::FILLED, cv::LINE_8,
+                    cv::noArray (), INT_MAX, -box.tl ());
+
+  SkeletonMetrics m = measure_skeleton (component);
+  d.length = m.length;
+  d.width = m.width;
+  d.curvature = m.curvature;
+}
+
+void
+defect_contours (const cv::Mat& defect_mask,
+                 std::vector<std::vector<cv::Point>>& contours,
+                 std::vector<uchar>& values)
+{
+  contours.clear ();
+  values.clear ();
+
+  /* Every boundary pixel, so the outline can be chain coded; the
+     polygon is the same one CHAIN_APPROX_SIMPLE would give.  */
+  cv::Mat dark = (defect_mask == DEFECT_DARK);
+  if (!cv::countNonZero (dark))
+    {
+      cv::findContours (defect_mask, contours,
+                        cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
+      for (const auto& c : contours)
+        values.push_back (defect_mask.at<uchar> (c[0]));
+      return;
+    }
+
+  /* Touching bright and dark blobs are separate defects.  */
+  cv::Mat bright = (defect_mask == DEFECT_BRIGHT);
+  for (cv::Mat* plane : { &bright, &dark })
+    {
+      std::vector<std::vector<cv::Point>> found;
+      cv::findContours (*plane, found,
+                        cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
+      uchar value = (plane == &dark) ? DEFECT_DARK : DEFECT_BRIGHT;
+      for (auto& c : found)
+        {
+          contours.push_back (std::move (c));
+          values.push_back (value);
+        }
+    }
+}
+
+/* CLASSIFY_AT (center, zone) yields the limits for a defect at CENTER
+   and the zone to record for it.  */
+template <typename ClassifyAt>
+static std::vector<Defect>
+analyze_components (const cv::Mat& defect_mask, ClassifyAt classify_at)
 {
   std::vector<std::vector<cv::Point>> contours;
-  cv::findContours (defect_mask, contours,
-                    cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+  std::vector<uchar> values;
+  defect_contours (defect_mask, contours, values);
 
   std::vector<Defect> defects;
+  std::vector<cv::Vec2i> scratch_jobs;
 
-  for (auto& c : contours)
+  for (int ci = 0; ci < (int)contours.size (); ci++)
     {
-      float area = (float)cv::contourArea (c);
-      if (area < 2.0f)
-        continue;
+      const auto& c = contours[ci];
 
       Defect d;
-      d.area = area;
-      d.boundingBox = cv::boundingRect (c);
+      if (!describe_defect (c, values[ci], d))
+        continue;
 
-      auto moments = cv::moments (c);
-      d.center = { (float)(moments.m10 / moments.m00),
-                   (float)(moments.m01 / moments.m00) };
+      classify_defect (d, classify_at (d.center, d.zone));
+      if (d.type == "scratch")
+        scratch_jobs.push_back ({ (int)defects.size (), ci });
 
-      float w = (float)d.boundingBox.width;
-      float h = (float)d.boundingBox.height;
-      float ar = w / std::max<float> (h, 1.0f);
-      d.ar = ar;
+      defects.push_back (d);
+    }
 
-      bool is_elongated = (ar > 2.5f || ar <= 0.70f);
-      bool is_large_enough = (area > 5.0f);
+  cv::parallel_for_ (cv::Range (0, (int)scratch_jobs.size ()),
+                     [&] (const cv::Range& range)
+    {
+      for (int i = range.start; i < range.end; i++)
+        measure_scratch (contours[scratch_jobs[i][1]],
+                         defects[scratch_jobs[i][0]]);
+    });
 
-      if (is_elongated && is_large_enough)
-        d.type = "scratch";
-      else if (area > 150.0f)
-        d.type = "cluster";
-      else
-        d.type = "speck";
+  return defects;
+}
 
-      defects.push_back (d);
+std::vector<Defect>
+analyze_defects (const cv::Mat& defect_mask, const ClassifyParams& params)
+{
+  return analyze_components (defect_mask, [&] (cv::Point2f, int&)
+    -> const ClassifyParams& { return params; });
+}
+
+std::vector<Defect>
+analyze_defects (const cv::Mat& defect_mask,
+                 const std::vector<ZoneParams>& zones,
+                 const ZoneMap& zone_map)
+{
+  CV_Assert (!zones.empty ());
+
+  return analyze_components (defect_mask, [&] (cv::Point2f center, int& zone)
+    -> const ClassifyParams&
+    {
+      zone = zone_at (zone_map, { cvRound (center.x), cvRound (center.y) });
+      /* A centroid can fall outside every zone (a curved scratch along
+         the outer boundary); the outermost zone is the nearest.  */
+      if (zone < 0)
+        zone = (int)zones.size () - 1;
+      return zones[zone].classify;
+    });
+}
+
+std::vector<ZoneStats>
+zone_statistics (const std::vector<Defect>& defects, int zone_count)
+{
+  std::vector<ZoneStats> stats (zone_count);
+  for (const auto& d : defects)
+    {
+      if (d.zone < 0 || d.zone >= zone_count)
+        continue;
+
+      ZoneStats& z = stats[d.zone];
+      z.defects++;
+      z.area += d.area;
+      if (d.type == "scratch")
+        z.scratches++;
+      else if (d.type == "cluster")
+        z.clusters++;
+      else
+        z.specks++;
     }
 
-  return defects;
+  return stats;
 }
 
 cv::Mat
@@ -0,0 +1,164 @@
+#include "defect_table.h"
+
+DefectTable::DefectTable (const cv::Mat& defect_mask,
+                          const ClassifyParams& params,
+                          const cv::Mat& intensity, int crop_margin)
+  : params_ (params)
+{
+  std::vector<std::vector<cv::Point>> contours;
+  std::vector<uchar> values;
+  defect_contours (defect_mask, contours, values);
+
+  cv::Rect image (cv::Point (), defect_mask.size ());
+  components_.reserve (contours.size ());
+
+  for (size_t ci = 0; ci < contours.size (); ci++)
+    {
+      const auto& contour = contours[ci];
+
+      /* The same cut describe_defect makes.  */
+      float area = (float)cv::contourArea (contour);
+      if (area < 2.0f)
+        continue;
+
+      Component c;
+      c.box = cv::boundingRect (contour);
+      c.area = area;
+      c.value = values[ci];
+      c.outline = encode_chain (contour);
+
+      if (!intensity.empty ())
+        {
+          cv::Rect crop_box = cv::Rect (c.box.x - crop_margin,
+                                        c.box.y - crop_margin,
+                                        c.box.width + 2 * crop_margin,
+                                        c.box.height + 2 * crop_margin)
+                              & image;
+          crop_boxes_.push_back (crop_box);
+          crops_.push_back (intensity (crop_box).clone ());
+        }
+      components_.push_back (std::move (c));
+    }
+}
+
+int
+DefectTable::size () const
+{
+  return (int)components_.size ();
+}
+
+float
+DefectTable::area (int i) const
+{
+  return components_[i].area;
+}
+
+cv::Rect
+DefectTable::box (int i) const
+{
+  return components_[i].box;
+}
+
+const ChainCode&
+DefectTable::outline (int i) const
+{
+  return components_[i].outline;
+}
+
+DefectTable::Details&
+DefectTable::details (int i) const
+{
+  if (details_.empty ())
+    details_.resize (components_.size ());
+
+  Details& d = details_[i];
+  if (d.contour.empty ())
+    d.contour = decode_chain (components_[i].outline);
+  return d;
+}
+
+const cv::Moments&
+DefectTable::moments (int i) const
+{
+  Details& d = details (i);
+  if (!d.has_moments)
+    {
+      d.moments = cv::moments (d.contour);
+      d.has_moments = true;
+    }
+  return d.moments;
+}
+
+cv::Point2f
+DefectTable::center (int i) const
+{
+  const cv::Moments& m = moments (i);
+  return { (float)(m.m10 / m.m00), (float)(m.m01 / m.m00) };
+}
+
+float
+DefectTable::orientation (int i) const
+{
+  const cv::Moments& m = moments (i);
+  return 0.5f * (float)std::atan2 (2.0 * m.mu11, m.mu20 - m.mu02);
+}
+
+IntensityStats
+DefectTable::intensity (int i) const
+{
+  IntensityStats s;
+  if (crops_.empty ())
+    return s;
+
+  const cv::Rect& crop_box = crop_boxes_[i];
+  cv::Mat region = cv::Mat::zeros (crop_box.size (), CV_8U);
+  std::vector<std::vector<cv::Point>> contour { details (i).contour };
+  cv::drawContours (region, contour, 0, cv::Scalar (255), cv::FILLED,
+                    cv::LINE_8, cv::noArray (), INT_MAX, -crop_box.tl ());
+
+  cv::Scalar mean, stddev;
+  cv::meanStdDev (crops_[i], mean, stddev, region);
+  double lo, hi;
+  cv::minMaxLoc (crops_[i], &lo, &hi, nullptr, nullptr, region);
+
+  s.mean = (float)mean[0];
+  s.stddev = (float)stddev[0];
+  s.min = (uchar)lo;
+  s.max = (uchar)hi;
+  return s;
+}
+
+cv::Mat
+DefectTable::crop (int i) const
+{
+  return crops_.empty () ? cv::Mat () : crops_[i];
+}
+
+void
+DefectTable::defect (int i, Defect& out) const
+{
+  /* Decoded afresh rather than through details (), so defects () does
+     not leave every contour cached.  */
+  std::vector<cv::Point> c = decode_chain (components_[i].outline);
+
+  Defect d;
+  describe_defect (c, components_[i].value, d);
+  classify_defect (d, params_);
+  if (d.type == "scratch")
+    measure_scratch (c, d);
+
+  out = d;
+}
+
+const std::vector<Defect>&
+DefectTable::defects () const
+{
+  if (!analyzed_)
+    {
+      defects_.resize (components_.size ());
+      for (int i = 0; i < size (); i++)
+        defect (i, defects_[i]);
+      analyzed_ = true;
+    }
+  return defects_;
+}
@@ -9,19 +9,10 @@ to_std_string (System::String^ s)
 System::Drawing::Bitmap^
 mat_to_bitmap (const cv::Mat& mat)
 {
-  cv::Mat bgr;
-  if (mat.channels () == 1)
-    cv::cvtColor (mat, bgr, cv::COLOR_GRAY2BGR);
-  else
-    bgr = mat;
-
-  cv::Mat rgb;
-  cv::cvtColor (bgr, rgb, cv::COLOR_BGR2RGB);
-
   System::Drawing::Bitmap^ bmp
     = gcnew System::Drawing::Bitmap 
     (
-        rgb.cols, rgb.rows,
+        mat.cols, mat.rows,
         System::Drawing::Imaging::PixelFormat::Format24bppRgb
     );
 
@@ -31,11 +22,16 @@ mat_to_bitmap (const cv::Mat& mat)
                      System::Drawing::Imaging::ImageLockMode::WriteOnly,
                      bmp->PixelFormat);
 
-  for (int y = 0; y < rgb.rows; y++)
-    memcpy (
-        (char*)bmp_data->Scan0.ToPointer () + y * bmp_data->Stride,
-        rgb.ptr (y),
-        rgb.cols * 3);
+  /* Convert straight into the locked bitmap memory; a Mat header over
+     Scan0 with the bitmap's stride avoids the intermediate image and
+     the row-by-row copy.  */
+  cv::Mat dst (mat.rows, mat.cols, CV_8UC3, bmp_data->Scan0.ToPointer (),
+               (size_t)bmp_data->Stride);
+
+  if (mat.channels () == 1)
+    cv::cvtColor (mat, dst, cv::COLOR_GRAY2RGB);
+  else
+    cv::cvtColor (mat, dst, cv::COLOR_BGR2RGB);
 
   bmp->UnlockBits (bmp_data);
   return bmp;
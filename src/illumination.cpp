@@ -0,0 +1,522 @@
+#include "illumination.h"
+
+static const double FIXED_POINT_SCALE = 256.0;
+
+static void
+derive_gain (BackgroundModel& model)
+{
+  model.background.convertTo (model.gain, CV_32F, 1.0 / FIXED_POINT_SCALE,
+                              1.0);
+  cv::divide (1.0, model.gain, model.gain);
+}
+
+BackgroundModel
+build_background_model (const std::vector<cv::Mat>& flats, int blur_size)
+{
+  CV_Assert (!flats.empty ());
+
+  if (blur_size % 2 == 0)
+    blur_size++;
+
+  std::vector<cv::Mat> smoothed (flats.size ());
+  for (int i = 0; i < (int)flats.size (); i++)
+    {
+      CV_Assert (flats[i].type () == CV_8U
+                 && flats[i].size () == flats[0].size ());
+
+      cv::Mat float_gray;
+      flats[i].convertTo (float_gray, CV_32F);
+      cv::GaussianBlur (float_gray, float_gray, { blur_size, blur_size }, 0);
+      float_gray.convertTo (smoothed[i], CV_16U, FIXED_POINT_SCALE);
+    }
+
+  /* Per-pixel median across flats rejects the occasional defect or
+     particle on an individual calibration wafer.  */
+  BackgroundModel model;
+  model.blur_size = blur_size;
+  model.background.create (flats[0].size (), CV_16U);
+
+  int n = (int)smoothed.size ();
+  cv::parallel_for_ (cv::Range (0, model.background.rows),
+                     [&] (const cv::Range& range)
+    {
+      std::vector<ushort> samples (n);
+      for (int y = range.start; y < range.end; y++)
+        {
+          ushort* dst = model.background.ptr<ushort> (y);
+          for (int x = 0; x < model.background.cols; x++)
+            {
+              for (int i = 0; i < n; i++)
+                samples[i] = smoothed[i].ptr<ushort> (y)[x];
+              std::nth_element (samples.begin (), samples.begin () + n / 2,
+                                samples.end ());
+              dst[x] = samples[n / 2];
+            }
+        }
+    });
+
+  derive_gain (model);
+
+  for (const auto& flat : flats)
+    {
+      cv::Mat lens = (flat > 8);
+      FlatFieldReport r = check_background_drift (flat, lens, model);
+      model.reference_drift = std::max (model.reference_drift, r.drift);
+    }
+
+  return model;
+}
+
+bool
+save_background_model (const BackgroundModel& model, const std::string& path)
+{
+  cv::FileStorage fs (path, cv::FileStorage::WRITE | cv::FileStorage::BASE64);
+  if (!fs.isOpened ())
+    return false;
+
+  fs << "blur_size" << model.blur_size;
+  fs << "reference_drift" << model.reference_drift;
+  fs << "drift_limit" << model.drift_limit;
+  fs << "background" << model.background;
+  return true;
+}
+
+BackgroundModel
+load_background_model (const std::string& path)
+{
+  BackgroundModel model;
+
+  cv::FileStorage fs (path, cv::FileStorage::READ);
+  if (!fs.isOpened ())
+    return model;
+
+  fs["blur_size"] >> model.blur_size;
+  fs["reference_drift"] >> model.reference_drift;
+  fs["drift_limit"] >> model.drift_limit;
+  fs["background"] >> model.background;
+
+  if (model.background.type () != CV_16U)
+    {
+      model.background.release ();
+      return model;
+    }
+
+  derive_gain (model);
+  return model;
+}
+
+FlatFieldReport
+check_background_drift (const cv::Mat& gray, const cv::Mat& mask,
+                        const BackgroundModel& model)
+{
+  CV_Assert (gray.size () == model.gain.size ());
+
+  const double block = 1.0 / 16.0;
+  FlatFieldReport report;
+
+  cv::Mat small_gray, small_gain, small_mask;
+  cv::resize (gray, small_gray, {}, block, block, cv::INTER_AREA);
+  cv::resize (model.gain, small_gain, small_gray.size (), 0, 0,
+              cv::INTER_AREA);
+  cv::resize (mask, small_mask, small_gray.size (), 0, 0, cv::INTER_AREA);
+
+  /* Only blocks fully inside the lens; edge blocks mix in background.  */
+  std::vector<float> ratios;
+  for (int y = 0; y < small_gray.rows; y++)
+    for (int x = 0; x < small_gray.cols; x++)
+      if (small_mask.at<uchar> (y, x) == 255)
+        ratios.push_back ((small_gray.at<uchar> (y, x) + 1.0f)
+                          * small_gain.at<float> (y, x));
+
+  if (ratios.size () < 16)
+    return report;
+
+  auto at = [&] (double q)
+    {
+      auto it = ratios.begin () + (size_t)(q * (ratios.size () - 1));
+      std::nth_element (ratios.begin (), it, ratios.end ());
+      return *it;
+    };
+
+  float median = at (0.5);
+  float lo = at (0.05);
+  float hi = at (0.95);
+
+  report.drift = (hi - lo) / std::max (median, 1e-6f);
+  report.needs_recalibration
+    = (report.drift > model.reference_drift + model.drift_limit);
+  return report;
+}
+
+/* Monomials u^i v^j with i + j <= degree, in a fixed order shared by the
+   fit and the evaluation.  */
+static std::vector<cv::Point>
+monomial_powers (int degree)
+{
+  std::vector<cv::Point> powers;
+  for (int total = 0; total <= degree; total++)
+    for (int j = 0; j <= total; j++)
+      powers.push_back ({ total - j, j });
+  return powers;
+}
+
+/* Coefficients of the robust fit described at fit_polynomial_background,
+   one per monomial_powers (DEGREE) term, over coordinates mapped to
+   [-1, 1].  DEGREE must already be clamped.  */
+static cv::Mat
+fit_surface (const cv::Mat& image, const cv::Mat& mask, int degree, int grid)
+{
+  auto powers = monomial_powers (degree);
+  int n_terms = (int)powers.size ();
+
+  cv::Size grid_size (std::min (grid, image.cols), std::min (grid, image.rows));
+  cv::Mat small_image, small_mask;
+  cv::resize (image, small_image, grid_size, 0, 0, cv::INTER_AREA);
+  cv::resize (mask, small_mask, grid_size, 0, 0, cv::INTER_AREA);
+  small_image.convertTo (small_image, CV_64F);
+
+  /* Coordinates are mapped to [-1, 1] to keep the normal equations
+     well conditioned up to degree 4.  */
+  double su = 2.0 / std::max (image.cols - 1, 1);
+  double sv = 2.0 / std::max (image.rows - 1, 1);
+  double cell_w = (double)image.cols / grid_size.width;
+  double cell_h = (double)image.rows / grid_size.height;
+
+  std::vector<cv::Vec3d> samples;
+  for (int y = 0; y < grid_size.height; y++)
+    for (int x = 0; x < grid_size.width; x++)
+      if (small_mask.at<uchar> (y, x) == 255)
+        samples.push_back ({ ((x + 0.5) * cell_w - 0.5) * su - 1.0,
+                             ((y + 0.5) * cell_h - 0.5) * sv - 1.0,
+                             small_image.at<double> (y, x) });
+
+  /* Too few samples for a fit leaves a flat surface at their mean.  */
+  cv::Mat coef = cv::Mat::zeros (n_terms, 1, CV_64F);
+  if ((int)samples.size () < 2 * n_terms)
+    {
+      if (!samples.empty ())
+        coef.at<double> (0) = cv::mean (small_image, small_mask == 255)[0];
+      return coef;
+    }
+
+  std::vector<uchar> inlier (samples.size (), 1);
+
+  /* Least squares over the current inliers; false, leaving COEF alone,
+     when too few remain.  */
+  auto fit_inliers = [&] ()
+    {
+      int n = 0;
+      for (uchar k : inlier)
+        n += k;
+      if (n < 2 * n_terms)
+        return false;
+
+      cv::Mat a (n, n_terms, CV_64F);
+      cv::Mat b (n, 1, CV_64F);
+      for (int i = 0, row = 0; i < (int)samples.size (); i++)
+        {
+          if (!inlier[i])
+            continue;
+          for (int t = 0; t < n_terms; t++)
+            a.at<double> (row, t) = std::pow (samples[i][0], powers[t].x)
+                                    * std::pow (samples[i][1], powers[t].y);
+          b.at<double> (row) = samples[i][2];
+          row++;
+        }
+
+      cv::solve (a, b, coef, cv::DECOMP_QR);
+      return true;
+    };
+
+  /* Up to three rejection rounds, each followed by a refit, so the
+     returned surface always comes from the final inlier set.  */
+  fit_inliers ();
+  for (int iter = 0; iter < 3; iter++)
+    {
+      std::vector<double> residuals (samples.size ());
+      std::vector<double> abs_inlier;
+      for (int i = 0; i < (int)samples.size (); i++)
+        {
+          double fit = 0.0;
+          for (int t = 0; t < n_terms; t++)
+            fit += coef.at<double> (t) * std::pow (samples[i][0], powers[t].x)
+                   * std::pow (samples[i][1], powers[t].y);
+          residuals[i] = samples[i][2] - fit;
+          if (inlier[i])
+            abs_inlier.push_back (std::abs (residuals[i]));
+        }
+
+      auto mid = abs_inlier.begin () + abs_inlier.size () / 2;
+      std::nth_element (abs_inlier.begin (), mid, abs_inlier.end ());
+      double sigma = std::max (1.4826 * *mid, 1e-3);
+
+      bool changed = false;
+      for (int i = 0; i < (int)samples.size (); i++)
+        {
+          uchar keep = (std::abs (residuals[i]) <= 2.5 * sigma);
+          changed |= (keep != inlier[i]);
+          inlier[i] = keep;
+        }
+      if (!changed || !fit_inliers ())
+        break;
+    }
+
+  return coef;
+}
+
+/* Evaluates the surface COEF of DEGREE over an image of SIZE row by row
+   with forward differences and hands every value, clamped at 0, to
+   STORE (x, y, value), rows in parallel.  */
+template <typename Store>
+static void
+evaluate_surface (cv::Size size, int degree, const cv::Mat& coef,
+                  Store store)
+{
+  auto powers = monomial_powers (degree);
+  int n_terms = (int)powers.size ();
+  double su = 2.0 / std::max (size.width - 1, 1);
+  double sv = 2.0 / std::max (size.height - 1, 1);
+
+  cv::parallel_for_ (cv::Range (0, size.height), [&] (const cv::Range& range)
+    {
+      double q[5];
+      double diff[5];
+
+      for (int y = range.start; y < range.end; y++)
+        {
+          /* Collapse to a 1-D polynomial in u for this row.  */
+          double v = y * sv - 1.0;
+          std::fill (q, q + 5, 0.0);
+          for (int t = 0; t < n_terms; t++)
+            q[powers[t].x] += coef.at<double> (t) * std::pow (v, powers[t].y);
+
+          /* Forward difference table at x = 0 .. degree.  */
+          for (int k = 0; k <= degree; k++)
+            {
+              double u = k * su - 1.0;
+              double p = 0.0;
+              for (int i = degree; i >= 0; i--)
+                p = p * u + q[i];
+              diff[k] = p;
+            }
+          for (int order = 1; order <= degree; order++)
+            for (int k = degree; k >= order; k--)
+              diff[k] -= diff[k - 1];
+
+          for (int x = 0; x < size.width; x++)
+            {
+              store (x, y, (float)std::max (diff[0], 0.0));
+              for (int k = 0; k < degree; k++)
+                diff[k] += diff[k + 1];
+            }
+        }
+    });
+}
+
+cv::Mat
+fit_polynomial_background (const cv::Mat& image, const cv::Mat& mask,
+                           int degree, int grid)
+{
+  degree = std::min (std::max (degree, 1), 4);
+  cv::Mat coef = fit_surface (image, mask, degree, grid);
+
+  cv::Mat background (image.size (), CV_32F);
+  evaluate_surface (image.size (), degree, coef,
+                    [&] (int x, int y, float value)
+    {
+      background.at<float> (y, x) = value;
+    });
+
+  return background;
+}
+
+void
+polynomial_flat_field (const cv::Mat& image, const cv::Mat& mask, int degree,
+                       cv::Mat& ratio, int grid)
+{
+  CV_Assert (image.type () == CV_32F);
+
+  degree = std::min (std::max (degree, 1), 4);
+  cv::Mat coef = fit_surface (image, mask, degree, grid);
+
+  ratio.create (image.size (), CV_32F);
+  evaluate_surface (image.size (), degree, coef,
+                    [&] (int x, int y, float value)
+    {
+      ratio.at<float> (y, x) = (image.at<float> (y, x) + 1.0f)
+                               / (value + 1.0f);
+    });
+}
+
+/* Kernel histogram of Perreault and Hebert.  The 16 coarse buckets
+   follow the window at every step; the 16 fine bins of a bucket are
+   brought up to date only when the median falls in that bucket, from the
+   columns that entered and left since its last refresh.  */
+struct MedianHistogram
+{
+  int coarse[16];
+  int fine[256];
+  /* Window centre each fine slice is valid for.  */
+  int refreshed[16];
+  int count;
+};
+
+/* Median filter of output columns [X0, X1).  Each stripe keeps its own
+   column histograms, covering R extra columns on either side.  */
+static void
+median_stripe (const cv::Mat& src, const cv::Mat& mask, int r, int x0,
+               int x1, cv::Mat& dst)
+{
+  int c0 = std::max (0, x0 - r);
+  int c1 = std::min (src.cols, x1 + r + 1);
+  int n_cols = c1 - c0;
+
+  std::vector<ushort> col_fine (n_cols * 256, 0);
+  std::vector<ushort> col_coarse (n_cols * 16, 0);
+  std::vector<int> col_count (n_cols, 0);
+
+  auto update_row = [&] (int y, int sign)
+    {
+      const uchar* s = src.ptr<uchar> (y);
+      const uchar* m = mask.ptr<uchar> (y);
+      for (int x = c0; x < c1; x++)
+        {
+          if (!m[x])
+            continue;
+          int c = x - c0;
+          col_fine[c * 256 + s[x]] += sign;
+          col_coarse[c * 16 + (s[x] >> 4)] += sign;
+          col_count[c] += sign;
+        }
+    };
+
+  MedianHistogram h;
+
+  auto add_column = [&] (int x, int sign)
+    {
+      if (x < c0 || x >= c1)
+        return;
+      const ushort* cc = &col_coarse[(x - c0) * 16];
+      for (int i = 0; i < 16; i++)
+        h.coarse[i] += sign * cc[i];
+      h.count += sign * col_count[x - c0];
+    };
+
+  auto add_slice = [&] (int b, int x, int sign)
+    {
+      if (x < c0 || x >= c1)
+        return;
+      const ushort* cf = &col_fine[(x - c0) * 256 + b * 16];
+      int* f = &h.fine[b * 16];
+      for (int i = 0; i < 16; i++)
+        f[i] += sign * cf[i];
+    };
+
+  /* Brings fine slice B to the window centred on X.  */
+  auto refresh = [&] (int b, int x)
+    {
+      int last = h.refreshed[b];
+      if (x - last > 2 * r)
+        {
+          std::fill (&h.fine[b * 16], &h.fine[b * 16] + 16, 0);
+          for (int c = x - r; c <= x + r; c++)
+            add_slice (b, c, 1);
+        }
+      else
+        for (int c = last + 1; c <= x; c++)
+          {
+            add_slice (b, c + r, 1);
+            add_slice (b, c - r - 1, -1);
+          }
+      h.refreshed[b] = x;
+    };
+
+  auto median = [&] (int x) -> uchar
+    {
+      if (h.count == 0)
+        return 0;
+
+      int half = (h.count - 1) / 2;
+      int sum = 0;
+      int bucket = 0;
+      while (sum + h.coarse[bucket] <= half)
+        sum += h.coarse[bucket++];
+
+      refresh (bucket, x);
+      int bin = bucket * 16;
+      while (sum + h.fine[bin] <= half)
+        sum += h.fine[bin++];
+
+      return (uchar)bin;
+    };
+
+  for (int y = 0; y < std::min (r, src.rows); y++)
+    update_row (y, 1);
+
+  for (int y = 0; y < src.rows; y++)
+    {
+      if (y + r < src.rows)
+        update_row (y + r, 1);
+      if (y - r - 1 >= 0)
+        update_row (y - r - 1, -1);
+
+      std::fill (h.coarse, h.coarse + 16, 0);
+      h.count = 0;
+      /* Far enough back that every slice is rebuilt on first use.  */
+      std::fill (h.refreshed, h.refreshed + 16, x0 - 2 * r - 1);
+      for (int x = x0 - r; x <= x0 + r; x++)
+        add_column (x, 1);
+
+      uchar* d = dst.ptr<uchar> (y);
+      for (int x = x0; x < x1; x++)
+        {
+          if (x > x0)
+            {
+              add_column (x + r, 1);
+              add_column (x - r - 1, -1);
+            }
+          d[x] = median (x);
+        }
+    }
+}
+
+cv::Mat
+median_background (const cv::Mat& gray, const cv::Mat& mask, int window,
+                   int downsample)
+{
+  CV_Assert (gray.type () == CV_8U && mask.type () == CV_8U);
+
+  downsample = std::max (downsample, 1);
+  cv::Mat small, small_mask;
+  if (downsample > 1)
+    {
+      double f = 1.0 / downsample;
+      cv::resize (gray, small, {}, f, f, cv::INTER_AREA);
+      cv::resize (mask, small_mask, small.size (), 0, 0, cv::INTER_AREA);
+      cv::threshold (small_mask, small_mask, 254, 255, cv::THRESH_BINARY);
+    }
+  else
+    {
+      small = gray;
+      small_mask = mask;
+    }
+
+  int r = std::max (1, window / (2 * downsample));
+  cv::Mat small_background (small.size (), CV_8U);
+
+  int stripes = std::max (1, std::min (cv::getNumThreads (), small.cols / 32));
+  cv::parallel_for_ (cv::Range (0, stripes), [&] (const cv::Range& range)
+    {
+      for (int s = range.start; s < range.end; s++)
+        median_stripe (small, small_mask, r, s * small.cols / stripes,
+                       (s + 1) * small.cols / stripes, small_background);
+    });
+
+  cv::Mat background;
+  small_background.convertTo (background, CV_32F);
+  if (downsample > 1)
+    cv::resize (background, background, gray.size (), 0, 0,
+                cv::INTER_LINEAR);
+
+  return background;
+}
\ No newline at end of file
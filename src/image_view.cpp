@@ -0,0 +1,63 @@
+#include "image_view.h"
+
+static int
+view_type (PixelFormat format)
+{
+  switch (format)
+    {
+    case PixelFormat::bgr24:
+      return CV_8UC3;
+    case PixelFormat::bgra32:
+      return CV_8UC4;
+    default:
+      return CV_8UC1;
+    }
+}
+
+cv::Mat
+wrap_view (const ImageView& view)
+{
+  CV_Assert (view.data && view.width > 0 && view.height > 0);
+
+  int type = view_type (view.format);
+  size_t stride = view.stride ? view.stride
+                              : (size_t)view.width * CV_ELEM_SIZE (type);
+  CV_Assert (stride >= (size_t)view.width * CV_ELEM_SIZE (type));
+
+  return cv::Mat (view.height, view.width, type, view.data, stride);
+}
+
+static cv::Mat
+wrap_output (const ImageView* view, cv::Size size)
+{
+  if (!view)
+    return cv::Mat ();
+
+  CV_Assert (view->format == PixelFormat::gray8);
+  CV_Assert (view->width == size.width && view->height == size.height);
+  return wrap_view (*view);
+}
+
+InspectionResult
+inspect_view (const ImageView& input, const Recipe& recipe,
+              const ImageView* corrected_out,
+              const ImageView* defect_mask_out)
+{
+  cv::Mat frame = wrap_view (input);
+
+  cv::Mat gray;
+  if (input.format == PixelFormat::gray8)
+    gray = frame;
+  else if (input.format == PixelFormat::bgr24)
+    cv::cvtColor (frame, gray, cv::COLOR_BGR2GRAY);
+  else
+    cv::cvtColor (frame, gray, cv::COLOR_BGRA2GRAY);
+
+  InspectionResult result;
+  result.corrected = wrap_output (corrected_out, gray.size ());
+  result.defect_mask = wrap_output (defect_mask_out, gray.size ());
+
+  inspect_into (gray, recipe, result);
+
+  return result;
+}
\ No newline at end of file
@@ -0,0 +1,507 @@
+#include "morphology.h"
+
+/* Neighbour bits, clockwise from north:
+   bit 0 = N, 1 = NE, 2 = E, 3 = SE, 4 = S, 5 = SW, 6 = W, 7 = NW.  */
+struct ThinningTables
+{
+  uchar remove[2][256];
+  uchar crossings[256];
+
+  ThinningTables ()
+  {
+    for (int code = 0; code < 256; code++)
+      {
+        int p[9];
+        for (int k = 0; k < 8; k++)
+          p[k] = (code >> k) & 1;
+        p[8] = p[0];
+
+        int b = 0;
+        int a = 0;
+        for (int k = 0; k < 8; k++)
+          {
+            b += p[k];
+            if (!p[k] && p[k + 1])
+              a++;
+          }
+
+        bool base = (b >= 2 && b <= 6 && a == 1);
+        remove[0][code] = base && !(p[0] && p[2] && p[4])
+                               && !(p[2] && p[4] && p[6]);
+        remove[1][code] = base && !(p[0] && p[2] && p[6])
+                               && !(p[0] && p[4] && p[6]);
+        crossings[code] = (uchar)a;
+      }
+  }
+};
+
+static const ThinningTables&
+thinning_tables ()
+{
+  static const ThinningTables tables;
+  return tables;
+}
+
+static const cv::Point NEIGHBOUR_OFFSETS[8] = {
+  { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 },
+  { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }
+};
+
+/* Expects a 0/1 image with a one pixel zero border.  */
+static inline int
+neighbour_code (const cv::Mat& img, cv::Point p)
+{
+  const uchar* up = img.ptr<uchar> (p.y - 1);
+  const uchar* mid = img.ptr<uchar> (p.y);
+  const uchar* down = img.ptr<uchar> (p.y + 1);
+  int x = p.x;
+
+  return up[x] | (up[x + 1] << 1) | (mid[x + 1] << 2) | (down[x + 1] << 3)
+         | (down[x] << 4) | (down[x - 1] << 5) | (mid[x - 1] << 6)
+         | (up[x - 1] << 7);
+}
+
+/* Thins a padded 0/1 image in place.  */
+static void
+thin_padded (cv::Mat& img)
+{
+  const ThinningTables& tables = thinning_tables ();
+  std::vector<uchar*> marked;
+
+  bool changed = true;
+  while (changed)
+    {
+      changed = false;
+      for (int pass = 0; pass < 2; pass++)
+        {
+          marked.clear ();
+          for (int y = 1; y < img.rows - 1; y++)
+            {
+              uchar* row = img.ptr<uchar> (y);
+              for (int x = 1; x < img.cols - 1; x++)
+                if (row[x]
+                    && tables.remove[pass][neighbour_code (img, { x, y })])
+                  marked.push_back (row + x);
+            }
+
+          for (uchar* p : marked)
+            *p = 0;
+          changed |= !marked.empty ();
+        }
+    }
+}
+
+static cv::Mat
+pad_binary (const cv::Mat& binary)
+{
+  cv::Mat ones;
+  cv::threshold (binary, ones, 0, 1, cv::THRESH_BINARY);
+
+  cv::Mat padded;
+  cv::copyMakeBorder (ones, padded, 1, 1, 1, 1, cv::BORDER_CONSTANT, 0);
+  return padded;
+}
+
+cv::Mat
+thin_zhang_suen (const cv::Mat& binary)
+{
+  cv::Mat img = pad_binary (binary);
+  thin_padded (img);
+
+  cv::Mat skeleton = img (cv::Rect (1, 1, binary.cols, binary.rows)) * 255;
+  return skeleton;
+}
+
+/* A thin path can only touch the few pixels just behind it.  */
+static inline bool
+recently_visited (const std::vector<cv::Point>& path, cv::Point q)
+{
+  int first = std::max (0, (int)path.size () - 4);
+  for (int i = first; i < (int)path.size (); i++)
+    if (path[i] == q)
+      return true;
+  return false;
+}
+
+/* Walks the skeleton from START, preferring 4-neighbours so staircase
+   corners are not skipped.  Stops on a junction (crossing number >= 3),
+   on another end point or after MAX_LEN pixels.  The stopping pixel is
+   the last element of the path.  */
+static std::vector<cv::Point>
+trace_branch (const cv::Mat& img, cv::Point start, int max_len)
+{
+  const ThinningTables& tables = thinning_tables ();
+  std::vector<cv::Point> path = { start };
+
+  cv::Point cur = start;
+  while ((int)path.size () <= max_len)
+    {
+      cv::Point next (-1, -1);
+      for (int pass = 0; pass < 2 && next.x < 0; pass++)
+        for (int k = pass; k < 8; k += 2)
+          {
+            cv::Point q = cur + NEIGHBOUR_OFFSETS[k];
+            if (!img.at<uchar> (q))
+              continue;
+            if (recently_visited (path, q))
+              continue;
+            next = q;
+            break;
+          }
+
+      if (next.x < 0)
+        break;
+
+      path.push_back (next);
+      int a = tables.crossings[neighbour_code (img, next)];
+      if (a != 2)
+        break;
+      cur = next;
+    }
+
+  return path;
+}
+
+static std::vector<cv::Point>
+find_end_points (const cv::Mat& img)
+{
+  const ThinningTables& tables = thinning_tables ();
+  std::vector<cv::Point> ends;
+
+  for (int y = 1; y < img.rows - 1; y++)
+    {
+      const uchar* row = img.ptr<uchar> (y);
+      for (int x = 1; x < img.cols - 1; x++)
+        if (row[x] && tables.crossings[neighbour_code (img, { x, y })] == 1)
+          ends.push_back ({ x, y });
+    }
+
+  return ends;
+}
+
+/* Removes branches that run from an end point into a junction in at most
+   MAX_SPUR pixels.  Two rounds catch spurs left behind by the first.  */
+static void
+prune_spurs (cv::Mat& img, int max_spur)
+{
+  const ThinningTables& tables = thinning_tables ();
+
+  for (int round = 0; round < 2; round++)
+    {
+      bool pruned = false;
+      for (cv::Point end : find_end_points (img))
+        {
+          if (!img.at<uchar> (end))
+            continue;
+
+          auto path = trace_branch (img, end, max_spur);
+          cv::Point last = path.back ();
+          if (tables.crossings[neighbour_code (img, last)] < 3)
+            continue;
+
+          for (int i = 0; i + 1 < (int)path.size (); i++)
+            img.at<uchar> (path[i]) = 0;
+          pruned = true;
+        }
+
+      if (!pruned)
+        break;
+    }
+}
+
+/* Sum of 4-steps plus the diagonal steps not already bridged by a
+   4-connected corner.  Works for branched and closed skeletons.  */
+static float
+skeleton_length (const cv::Mat& img)
+{
+  const float diag = (float)CV_SQRT2;
+  float length = 0.0f;
+
+  for (int y = 1; y < img.rows - 1; y++)
+    {
+      const uchar* row = img.ptr<uchar> (y);
+      const uchar* down = img.ptr<uchar> (y + 1);
+      for (int x = 1; x < img.cols - 1; x++)
+        {
+          if (!row[x])
+            continue;
+
+          length += row[x + 1] + down[x];
+          if (down[x + 1] && !row[x + 1] && !down[x])
+            length += diag;
+          if (down[x - 1] && !row[x - 1] && !down[x])
+            length += diag;
+        }
+    }
+
+  return length;
+}
+
+/* Mean absolute turning angle per pixel along the main branch, sampled
+   every STEP pixels so single-pixel staircase jitter does not count.  */
+static float
+path_curvature (const std::vector<cv::Point>& path, int step)
+{
+  if ((int)path.size () < 2 * step + 1)
+    return 0.0f;
+
+  float turning = 0.0f;
+  float travelled = 0.0f;
+  double prev_angle = 0.0;
+  bool has_prev = false;
+
+  for (int i = step; i < (int)path.size (); i += step)
+    {
+      cv::Point d = path[i] - path[i - step];
+      double angle = std::atan2 ((double)d.y, (double)d.x);
+      if (has_prev)
+        {
+          double delta = angle - prev_angle;
+          while (delta > CV_PI)
+            delta -= 2.0 * CV_PI;
+          while (delta < -CV_PI)
+            delta += 2.0 * CV_PI;
+          turning += (float)std::abs (delta);
+        }
+      travelled += (float)cv::norm (d);
+      prev_angle = angle;
+      has_prev = true;
+    }
+
+  return turning / std::max<float> (travelled, 1.0f);
+}
+
+SkeletonMetrics
+measure_skeleton (const cv::Mat& component)
+{
+  SkeletonMetrics metrics;
+
+  float area = (float)cv::countNonZero (component);
+  if (area <= 0.0f)
+    return metrics;
+
+  cv::Mat img = pad_binary (component);
+  thin_padded (img);
+
+  /* Spurs are the thinning's response to boundary bumps; they are never
+     longer than about the local width.  */
+  float rough_width
+    = area / std::max<float> ((float)cv::countNonZero (img), 1.0f);
+  prune_spurs (img, std::max (2, (int)std::ceil (rough_width)));
+
+  /* Thinning eats roughly half the width at each end of the stroke, so
+     with true length L = s + w and area = L * w the width solves
+     w^2 + s*w - area = 0.  */
+  float s = skeleton_length (img);
+  float width = 0.5f * (-s + std::sqrt (s * s + 4.0f * area));
+  metrics.width = width;
+  metrics.length = s + width;
+
+  auto ends = find_end_points (img);
+  if (!ends.empty ())
+    {
+      auto path = trace_branch (img, ends.front (), img.rows * img.cols);
+      int step = std::max (3, (int)std::lround (width));
+      metrics.curvature = path_curvature (path, step);
+    }
+
+  return metrics;
+}
+
+void
+area_open (cv::Mat& binary, int min_area, int ccl_algorithm)
+{
+  cv::Mat labels, stats, centroids;
+  int n = cv::connectedComponentsWithStats (binary, labels, stats, centroids,
+                                            8, CV_32S, ccl_algorithm);
+
+  std::vector<uchar> keep (n, 0);
+  bool removed = false;
+  for (int i = 1; i < n; i++)
+    {
+      keep[i] = (stats.at<int> (i, cv::CC_STAT_AREA) >= min_area);
+      removed |= !keep[i];
+    }
+
+  if (!removed)
+    return;
+
+  cv::parallel_for_ (cv::Range (0, binary.rows), [&] (const cv::Range& range)
+    {
+      for (int y = range.start; y < range.end; y++)
+        {
+          const int* lab = labels.ptr<int> (y);
+          uchar* px = binary.ptr<uchar> (y);
+          for (int x = 0; x < binary.cols; x++)
+            if (!keep[lab[x]])
+              px[x] = 0;
+        }
+    });
+}
+
+/* a - b for openings, b - a for closings, saturated at zero.  */
+static void
+band_difference (const cv::Mat& a, const cv::Mat& b, int op, cv::Mat& band)
+{
+  if (op == cv::MORPH_OPEN)
+    cv::subtract (a, b, band);
+  else
+    cv::subtract (b, a, band);
+}
+
+/* Opening or closing over horizontal bands.  Each band is filtered with
+   a halo of KERNEL.rows rows, enough for the erode-dilate pair, and only
+   its own rows are kept.  */
+static void
+morphology_banded (const cv::Mat& src, cv::Mat& dst, int op,
+                   const cv::Mat& kernel)
+{
+  int halo = kernel.rows;
+  int band = std::max (64, 4 * halo);
+  int n_bands = (src.rows + band - 1) / band;
+
+  dst.create (src.size (), src.type ());
+  cv::parallel_for_ (cv::Range (0, n_bands), [&] (const cv::Range& range)
+    {
+      for (int b = range.start; b < range.end; b++)
+        {
+          int y0 = b * band;
+          int y1 = std::min (src.rows, y0 + band);
+          int h0 = std::max (0, y0 - halo);
+          int h1 = std::min (src.rows, y1 + halo);
+
+          cv::Mat filtered;
+          cv::morphologyEx (src.rowRange (h0, h1), filtered, op, kernel);
+          filtered.rowRange (y0 - h0, y1 - h0).copyTo (dst.rowRange (y0, y1));
+        }
+    });
+}
+
+/* Opening and closing of SRC in one pass over horizontal bands: each
+   band and its halo are eroded and dilated while they are in cache, and
+   the second filter of each pair runs on the band's own result.  Equal
+   to two calls of morphology_banded.  */
+static void
+open_close_banded (const cv::Mat& src, const cv::Mat& kernel,
+                   cv::Mat& opened, cv::Mat& closed)
+{
+  int halo = kernel.rows;
+  int band = std::max (64, 4 * halo);
+  int n_bands = (src.rows + band - 1) / band;
+
+  opened.create (src.size (), src.type ());
+  closed.create (src.size (), src.type ());
+  cv::parallel_for_ (cv::Range (0, n_bands), [&] (const cv::Range& range)
+    {
+      cv::Mat eroded, dilated, o, c;
+      for (int b = range.start; b < range.end; b++)
+        {
+          int y0 = b * band;
+          int y1 = std::min (src.rows, y0 + band);
+          int h0 = std::max (0, y0 - halo);
+          int h1 = std::min (src.rows, y1 + halo);
+
+          cv::Mat rows = src.rowRange (h0, h1);
+          cv::erode (rows, eroded, kernel);
+          cv::dilate (rows, dilated, kernel);
+          cv::dilate (eroded, o, kernel);
+          cv::erode (dilated, c, kernel);
+          o.rowRange (y0 - h0, y1 - h0).copyTo (opened.rowRange (y0, y1));
+          c.rowRange (y0 - h0, y1 - h0).copyTo (closed.rowRange (y0, y1));
+        }
+    });
+}
+
+/* Folds the band between FILTERED and its opening (closing) at SCALE
+   into RESPONSE, then advances FILTERED to that opening (closing).  */
+static void
+add_scale (cv::Mat& filtered, cv::Mat& response, int base, int scale, int op)
+{
+  int factor = 1;
+  while (scale / (factor * 2) >= base)
+    factor *= 2;
+  int ksize = std::max (3, (scale / factor) | 1);
+  auto coarse_kernel
+    = cv::getStructuringElement (cv::MORPH_ELLIPSE, { ksize, ksize });
+
+  /* Filtering the previous result instead of the source is exact only
+     when the larger kernel is open with respect to the smaller one
+     (nested flat structuring elements).  Digital ellipses of different
+     sizes, and kernels on a decimated grid, are only close to that, so
+     the bands approximate the per-scale top-hats.  */
+  cv::Mat coarse;
+  if (factor > 1)
+    cv::resize (filtered, coarse, {}, 1.0 / factor, 1.0 / factor,
+                cv::INTER_AREA);
+  else
+    coarse = filtered;
+
+  cv::Mat coarse_filtered;
+  cv::morphologyEx (coarse, coarse_filtered, op, coarse_kernel);
+
+  cv::Mat next;
+  if (factor > 1)
+    cv::resize (coarse_filtered, next, filtered.size (), 0, 0,
+                cv::INTER_LINEAR);
+  else
+    next = coarse_filtered;
+
+  if (op == cv::MORPH_OPEN)
+    cv::min (next, filtered, next);
+  else
+    cv::max (next, filtered, next);
+
+  cv::Mat band;
+  band_difference (filtered, next, op, band);
+  cv::max (response, band, response);
+
+  filtered = next;
+}
+
+cv::Mat
+tophat_bank (const cv::Mat& src, const std::vector<int>& scales, int op,
+             bool banded)
+{
+  CV_Assert (!scales.empty ());
+  CV_Assert (op == cv::MORPH_OPEN || op == cv::MORPH_CLOSE);
+
+  int base = scales[0];
+  auto kernel = cv::getStructuringElement (cv::MORPH_ELLIPSE, { base, base });
+
+  cv::Mat filtered;
+  if (banded)
+    morphology_banded (src, filtered, op, kernel);
+  else
+    cv::morphologyEx (src, filtered, op, kernel);
+
+  cv::Mat response;
+  band_difference (src, filtered, op, response);
+
+  for (int k = 1; k < (int)scales.size (); k++)
+    add_scale (filtered, response, base, scales[k], op);
+
+  return response;
+}
+
+void
+tophat_bank (const cv::Mat& src, const std::vector<int>& scales,
+             cv::Mat& white, cv::Mat& black)
+{
+  CV_Assert (!scales.empty ());
+
+  int base = scales[0];
+  auto kernel = cv::getStructuringElement (cv::MORPH_ELLIPSE, { base, base });
+
+  cv::Mat opened, closed;
+  open_close_banded (src, kernel, opened, closed);
+  band_difference (src, opened, cv::MORPH_OPEN, white);
+  band_difference (src, closed, cv::MORPH_CLOSE, black);
+
+  /* The coarser scales work on decimated images and are cheap next to
+     the full resolution pair above.  */
+  for (int k = 1; k < (int)scales.size (); k++)
+    {
+      add_scale (opened, white, base, scales[k], cv::MORPH_OPEN);
+      add_scale (closed, black, base, scales[k], cv::MORPH_CLOSE);
+    }
+}
@@ -0,0 +1,77 @@
+#include "outline.h"
+
+static const cv::Point STEPS[8] = {
+  { 1, 0 }, { 1, -1 }, { 0, -1 }, { -1, -1 },
+  { -1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 }
+};
+
+/* Direction code for a step (dx + 1, dy + 1); -1 for a non-step.  */
+static const int CODES[3][3] = {
+  { 3, 4, 5 },
+  { 2, -1, 6 },
+  { 1, 0, 7 }
+};
+
+ChainCode
+encode_chain (const std::vector<cv::Point>& contour)
+{
+  ChainCode chain;
+  if (contour.empty ())
+    return chain;
+
+  chain.start = contour[0];
+  chain.points = (uint32_t)contour.size ();
+  uint32_t steps = chain.points - 1;
+  chain.bits.assign ((steps * 3 + 7) / 8, 0);
+
+  for (uint32_t i = 0; i < steps; i++)
+    {
+      cv::Point d = contour[i + 1] - contour[i];
+      CV_Assert (std::abs (d.x) <= 1 && std::abs (d.y) <= 1);
+      int code = CODES[d.x + 1][d.y + 1];
+      CV_Assert (code >= 0);
+
+      uint32_t bit = i * 3;
+      chain.bits[bit / 8] |= (uint8_t)(code << (bit % 8));
+      if (bit % 8 > 5)
+        chain.bits[bit / 8 + 1] |= (uint8_t)(code >> (8 - bit % 8));
+    }
+
+  return chain;
+}
+
+std::vector<cv::Point>
+decode_chain (const ChainCode& chain)
+{
+  std::vector<cv::Point> points;
+  if (chain.points == 0)
+    return points;
+
+  points.reserve (chain.points);
+  cv::Point p = chain.start;
+  points.push_back (p);
+
+  for (uint32_t i = 0; i + 1 < chain.points; i++)
+    {
+      uint32_t bit = i * 3;
+      int code = chain.bits[bit / 8] >> (bit % 8);
+      if (bit % 8 > 5)
+        code |= chain.bits[bit / 8 + 1] << (8 - bit % 8);
+      p += STEPS[code & 7];
+      points.push_back (p);
+    }
+
+  return points;
+}
+
+std::vector<cv::Point>
+outline_polygon (const ChainCode& chain, double epsilon)
+{
+  std::vector<cv::Point> points = decode_chain (chain);
+  if (points.size () < 3)
+    return points;
+
+  std::vector<cv::Point> polygon;
+  cv::approxPolyDP (points, polygon, epsilon, true);
+  return polygon;
+}
@@ -0,0 +1,257 @@
+#include "pipeline.h"
+#include "autotune.h"
+
+/* Defect-to-lens pixel ratio and the pass verdict.  */
+static void
+judge (const Recipe& recipe, InspectionResult& result)
+{
+  float lens_pixels = (float)cv::countNonZero (result.mask);
+  float defect_pixels = (float)cv::countNonZero (result.defect_mask);
+  result.ratio = defect_pixels / std::max<float> (lens_pixels, 1.0f);
+  result.pass = (result.ratio < recipe.pass_ratio);
+}
+
+const std::vector<Defect>&
+InspectionResult::all_defects () const
+{
+  return table.size () > 0 ? table.defects () : defects;
+}
+
+size_t
+InspectionResult::defect_count () const
+{
+  return table.size () > 0 ? (size_t)table.size () : defects.size ();
+}
+
+void
+inspect_into (const cv::Mat& gray, const Recipe& recipe,
+              InspectionResult& result)
+{
+  result.mask = extract_lens_mask (gray);
+  correct_illumination (gray, result.mask, recipe.illumination,
+                        result.corrected);
+  inspect_corrected (recipe, result);
+}
+
+void
+inspect_corrected (const Recipe& recipe, InspectionResult& result)
+{
+  if (recipe.zones.empty ())
+    {
+      detect_defects (result.corrected, result.mask, recipe.detect,
+                      result.defect_mask);
+      result.defects = analyze_defects (result.defect_mask, recipe.classify);
+      result.zone_stats.clear ();
+    }
+  else
+    {
+      std::vector<float> radii;
+      for (const auto& z : recipe.zones)
+        radii.push_back (z.outer_radius);
+      ZoneMap zone_map = build_zone_map (result.mask.size (),
+                                         fit_wafer_geometry (result.mask),
+                                         radii);
+
+      detect_defects (result.corrected, result.mask, recipe.detect,
+                      recipe.zones, zone_map, result.defect_mask);
+      result.defects = analyze_defects (result.defect_mask, recipe.zones,
+                                        zone_map);
+      result.zone_stats = zone_statistics (result.defects,
+                                           (int)recipe.zones.size ());
+    }
+
+  judge (recipe, result);
+}
+
+InspectionResult
+inspect (const cv::Mat& gray, const Recipe& recipe)
+{
+  InspectionResult result;
+  inspect_into (gray, recipe, result);
+
+  return result;
+}
+
+std::vector<InspectionResult>
+analyze_batch (const std::vector<cv::Mat>& gray_images, const Recipe& recipe,
+               bool keep_images)
+{
+  int count = (int)gray_images.size ();
+  std::vector<InspectionResult> results (count);
+
+  /* Recipe setup done once for the whole batch.  */
+  Recipe prepared = recipe;
+  std::sort (prepared.detect.tophat_scales.begin (),
+             prepared.detect.tophat_scales.end ());
+
+  std::vector<int> order (count);
+  for (int i = 0; i < count; i++)
+    order[i] = i;
+  std::stable_sort (order.begin (), order.end (), [&] (int a, int b)
+    {
+      const cv::Mat& x = gray_images[a];
+      const cv::Mat& y = gray_images[b];
+      return (x.rows != y.rows) ? x.rows < y.rows : x.cols < y.cols;
+    });
+
+  auto run = [&] (const cv::Range& range)
+    {
+      InspectionResult scratch;
+      for (int i = range.start; i < range.end; i++)
+        {
+          int index = order[i];
+          if (keep_images)
+            {
+              inspect_into (gray_images[index], prepared, results[index]);
+              continue;
+            }
+
+          InspectionResult& r = results[index];
+          if (!prepared.zones.empty ())
+            {
+              /* Zone statistics need every defect classified.  */
+              inspect_into (gray_images[index], prepared, scratch);
+              r.defects = std::move (scratch.defects);
+              r.zone_stats = std::move (scratch.zone_stats);
+            }
+          else
+            {
+              const cv::Mat& gray = gray_images[index];
+              scratch.mask = extract_lens_mask (gray);
+              correct_illumination (gray, scratch.mask, prepared.illumination,
+                                    scratch.corrected);
+              detect_defects (scratch.corrected, scratch.mask,
+                              prepared.detect, scratch.defect_mask);
+              judge (prepared, scratch);
+              r.table = DefectTable (scratch.defect_mask, prepared.classify);
+            }
+          r.ratio = scratch.ratio;
+          r.pass = scratch.pass;
+        }
+    };
+
+  int threads = std::max (cv::getNumThreads (), 1);
+  if (count >= threads && threads > 1)
+    cv::parallel_for_ (cv::Range (0, count), run, threads);
+  else
+    run (cv::Range (0, count));
+
+  return results;
+}
+
+/* True when A and B produce the same top-hat response, i.e. differ at
+   most in the threshold cut, area opening, classification and verdict.  */
+static bool
+same_upstream (const Recipe& a, const Recipe& b)
+{
+  const IlluminationParams& ia = a.illumination;
+  const IlluminationParams& ib = b.illumination;
+  const DetectParams& da = a.detect;
+  const DetectParams& db = b.detect;
+
+  return ia.estimator == ib.estimator && ia.blur_size == ib.blur_size
+         && ia.decimated_blur == ib.decimated_blur
+         && ia.poly_degree == ib.poly_degree
+         && ia.median_downsample == ib.median_downsample
+         && ia.normalization == ib.normalization
+         && ia.low_percentile == ib.low_percentile
+         && ia.high_percentile == ib.high_percentile
+         && da.clahe_clip == db.clahe_clip && da.clahe_tiles == db.clahe_tiles
+         && da.masked_clahe == db.masked_clahe
+         && da.tophat_scales == db.tophat_scales
+         && da.detect_dark == db.detect_dark
+         && da.banded_tophat == db.banded_tophat;
+}
+
+std::vector<InspectionResult>
+inspect_variants (const cv::Mat& gray, const std::vector<Recipe>& recipes)
+{
+  int count = (int)recipes.size ();
+  std::vector<InspectionResult> results (count);
+  if (recipes.empty ())
+    return results;
+
+  cv::Mat mask = extract_lens_mask (gray);
+  float lens_pixels = std::max<float> ((float)cv::countNonZero (mask), 1.0f);
+
+  std::vector<bool> done (count, false);
+  for (int i = 0; i < count; i++)
+    {
+      if (done[i])
+        continue;
+
+      /* Zoned thresholds are not among the shared cuts.  */
+      if (!recipes[i].zones.empty ())
+        {
+          inspect_into (gray, recipes[i], results[i]);
+          done[i] = true;
+          continue;
+        }
+
+      std::vector<int> group;
+      std::vector<DetectParams> cuts;
+      for (int j = i; j < count; j++)
+        if (!done[j] && recipes[j].zones.empty ()
+            && same_upstream (recipes[i], recipes[j]))
+          {
+            group.push_back (j);
+            cuts.push_back (recipes[j].detect);
+            done[j] = true;
+          }
+
+      cv::Mat corrected;
+      correct_illumination (gray, mask, recipes[i].illumination, corrected);
+      std::vector<cv::Mat> defect_masks = detect_defects (corrected, mask,
+                                                          cuts);
+
+      for (int g = 0; g < (int)group.size (); g++)
+        {
+          const Recipe& recipe = recipes[group[g]];
+          InspectionResult& r = results[group[g]];
+          r.mask = mask;
+          r.corrected = corrected;
+          r.defect_mask = defect_masks[g];
+
+          r.ratio = (float)cv::countNonZero (r.defect_mask) / lens_pixels;
+          r.defects = analyze_defects (r.defect_mask, recipe.classify);
+          r.pass = (r.ratio < recipe.pass_ratio);
+        }
+    }
+
+  return results;
+}
+
+static double
+elapsed_ms (int64 since)
+{
+  return (cv::getTickCount () - since) * 1000.0 / cv::getTickFrequency ();
+}
+
+WarmupReport
+warm_up (cv::Size size, const Recipe& recipe)
+{
+  WarmupReport report;
+
+  int64 t0 = cv::getTickCount ();
+
+  /* Thread pool creation happens on the first parallel region.  */
+  int threads = cv::getNumThreads ();
+  cv::parallel_for_ (cv::Range (0, std::max (threads, 1)),
+                     [] (const cv::Range&) {});
+  cv::getCPUFeaturesLine ();
+  cv::createCLAHE (recipe.detect.clahe_clip, recipe.detect.clahe_tiles);
+
+  report.startup_ms = elapsed_ms (t0);
+
+  cv::Mat gray = make_synthetic_wafer (size);
+
+  int64 t1 = cv::getTickCount ();
+  inspect (gray, recipe);
+  report.first_result_ms = elapsed_ms (t1);
+
+  int64 t2 = cv::getTickCount ();
+  inspect (gray, recipe);
+  report.warm_result_ms = elapsed_ms (t2);
+
+  return report;
+}
\ No newline at end of file
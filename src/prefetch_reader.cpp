@@ -0,0 +1,333 @@
+#include "prefetch_reader.h"
+#include <cstdint>
+#include <fstream>
+
+#ifdef WAFER_WITH_IO_URING
+#include <cerrno>
+#include <fcntl.h>
+#include <liburing.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Page alignment keeps the buffers usable for direct I/O and stops two
+   slots sharing a cache line.  */
+static const size_t BUFFER_ALIGN = 4096;
+
+PrefetchReader::PrefetchReader (const std::vector<std::string>& paths,
+                                int depth, int decode_threads,
+                                int imread_flags)
+  : paths_ (paths), flags_ (imread_flags),
+    slots_ (std::max (depth, 1))
+{
+  decode_threads = std::max (decode_threads, 1);
+
+#ifdef WAFER_WITH_IO_URING
+  /* Without io_uring in this kernel or sandbox the decoders do their
+     own blocking reads.  */
+  ring_ = new io_uring;
+  if (io_uring_queue_init ((unsigned)slots_.size (), ring_, 0) < 0)
+    {
+      delete ring_;
+      ring_ = nullptr;
+    }
+  io_uring_ = (ring_ != nullptr);
+  if (io_uring_)
+    threads_.emplace_back (&PrefetchReader::fetch_loop, this);
+#endif
+
+  for (int i = 0; i < decode_threads; i++)
+    threads_.emplace_back (&PrefetchReader::decode_loop, this);
+}
+
+PrefetchReader::~PrefetchReader ()
+{
+  {
+    std::lock_guard<std::mutex> guard (lock_);
+    stop_ = true;
+  }
+  changed_.notify_all ();
+
+  for (auto& t : threads_)
+    t.join ();
+
+#ifdef WAFER_WITH_IO_URING
+  if (ring_)
+    {
+      io_uring_queue_exit (ring_);
+      delete ring_;
+    }
+#endif
+}
+
+bool
+PrefetchReader::uses_io_uring () const
+{
+  return io_uring_;
+}
+
+PrefetchReader::Slot&
+PrefetchReader::slot_for (size_t index)
+{
+  return slots_[index % slots_.size ()];
+}
+
+void
+PrefetchReader::reserve (Slot& slot, size_t size)
+{
+  if (slot.data && slot.data + size <= slot.storage.data ()
+                                         + slot.storage.size ())
+    return;
+
+  /* Grow in 1 MiB steps so slightly larger files do not reallocate.  */
+  size_t capacity = ((size >> 20) + 1) << 20;
+  slot.storage.resize (capacity + BUFFER_ALIGN);
+  uintptr_t base = (uintptr_t)slot.storage.data ();
+  slot.data = (uchar*)((base + BUFFER_ALIGN - 1) & ~(BUFFER_ALIGN - 1));
+}
+
+bool
+PrefetchReader::read_file (const std::string& path, Slot& slot)
+{
+  slot.size = 0;
+
+  std::ifstream file (path, std::ios::binary | std::ios::ate);
+  if (!file)
+    return false;
+
+  size_t size = (size_t)file.tellg ();
+  reserve (slot, size);
+  file.seekg (0);
+  if (!file.read ((char*)slot.data, size))
+    return false;
+
+  slot.size = size;
+  return true;
+}
+
+void
+PrefetchReader::decode_loop ()
+{
+  size_t count = paths_.size ();
+  std::unique_lock<std::mutex> guard (lock_);
+
+  for (;;)
+    {
+      changed_.wait (guard, [&]
+        {
+          if (stop_ || next_decode_ >= count)
+            return true;
+          Slot& s = slot_for (next_decode_);
+          return io_uring_ ? (s.state == SlotState::loaded
+                              && s.index == next_decode_)
+                           : s.state == SlotState::free;
+        });
+      if (stop_ || next_decode_ >= count)
+        return;
+
+      size_t index = next_decode_++;
+      bool fetched = io_uring_;
+      Slot& slot = slot_for (index);
+      slot.index = index;
+      slot.state = fetched ? SlotState::decoding : SlotState::loading;
+      guard.unlock ();
+
+      bool loaded = fetched ? slot.size > 0
+                            : read_file (paths_[index], slot);
+      cv::Mat image;
+      if (loaded)
+        image = cv::imdecode (cv::Mat (1, (int)slot.size, CV_8U, slot.data),
+                              flags_);
+
+      guard.lock ();
+      slot.image = image;
+      slot.state = SlotState::ready;
+      changed_.notify_all ();
+    }
+}
+
+bool
+PrefetchReader::next (cv::Mat& image, std::string* path)
+{
+  std::unique_lock<std::mutex> guard (lock_);
+  if (next_out_ >= paths_.size ())
+    return false;
+
+  Slot& slot = slot_for (next_out_);
+  changed_.wait (guard, [&]
+    {
+      return slot.state == SlotState::ready && slot.index == next_out_;
+    });
+
+  image = slot.image;
+  slot.image.release ();
+  slot.state = SlotState::free;
+  if (path)
+    *path = paths_[next_out_];
+  next_out_++;
+
+  changed_.notify_all ();
+  return true;
+}
+
+#ifdef WAFER_WITH_IO_URING
+
+void
+PrefetchReader::fetch_loop ()
+{
+  size_t count = paths_.size ();
+  size_t depth = slots_.size ();
+
+  io_uring& ring = *ring_;
+  std::vector<int> fds (depth, -1);
+  std::vector<size_t> done (depth, 0);
+  std::vector<size_t> expected (depth, 0);
+  /* File index of the read queued on each slot, while FDS is open.  */
+  std::vector<size_t> reading (depth, 0);
+  size_t in_flight = 0;
+
+  auto queue_read = [&] (size_t index)
+    {
+      size_t s = index % depth;
+      io_uring_sqe* sqe = io_uring_get_sqe (&ring);
+      io_uring_prep_read (sqe, fds[s], slots_[s].data + done[s],
+                          (unsigned)(expected[s] - done[s]), done[s]);
+      io_uring_sqe_set_data64 (sqe, index);
+    };
+
+  auto finish = [&] (size_t index, size_t size)
+    {
+      size_t s = index % depth;
+      if (fds[s] >= 0)
+        close (fds[s]);
+      fds[s] = -1;
+
+      std::lock_guard<std::mutex> guard (lock_);
+      slots_[s].size = size;
+      slots_[s].state = SlotState::loaded;
+      changed_.notify_all ();
+    };
+
+  for (;;)
+    {
+      std::vector<size_t> claimed;
+      {
+        std::unique_lock<std::mutex> guard (lock_);
+        if (in_flight == 0)
+          changed_.wait (guard, [&]
+            {
+              return stop_ || next_fetch_ >= count
+                     || slot_for (next_fetch_).state == SlotState::free;
+            });
+        if (stop_ || (next_fetch_ >= count && in_flight == 0))
+          break;
+
+        while (next_fetch_ < count
+               && slot_for (next_fetch_).state == SlotState::free)
+          {
+            Slot& slot = slot_for (next_fetch_);
+            slot.index = next_fetch_;
+            slot.state = SlotState::loading;
+            claimed.push_back (next_fetch_++);
+          }
+      }
+
+      for (size_t index : claimed)
+        {
+          size_t s = index % depth;
+          struct stat st;
+          fds[s] = open (paths_[index].c_str (), O_RDONLY);
+          if (fds[s] < 0 || fstat (fds[s], &st) < 0 || st.st_size == 0)
+            {
+              finish (index, 0);
+              continue;
+            }
+
+          expected[s] = (size_t)st.st_size;
+          done[s] = 0;
+          reading[s] = index;
+          reserve (slots_[s], expected[s]);
+          queue_read (index);
+          in_flight++;
+        }
+
+      if (in_flight == 0)
+        continue;
+      io_uring_submit (&ring);
+
+      io_uring_cqe* cqe;
+      if (io_uring_wait_cqe (&ring, &cqe) < 0)
+        continue;
+
+      do
+        {
+          size_t index = io_uring_cqe_get_data64 (cqe);
+          size_t s = index % depth;
+          int res = cqe->res;
+          io_uring_cqe_seen (&ring, cqe);
+
+          if (res <= 0)
+            {
+              in_flight--;
+              finish (index, 0);
+            }
+          else if ((done[s] += res) < expected[s])
+            {
+              queue_read (index);
+              io_uring_submit (&ring);
+            }
+          else
+            {
+              in_flight--;
+              finish (index, expected[s]);
+            }
+        }
+      while (io_uring_peek_cqe (&ring, &cqe) == 0);
+    }
+
+  /* Stopped with reads still queued: the kernel may write into the
+     slot buffers until their completions arrive, so cancel them and
+     wait those out before the fds close and the destructor frees the
+     buffers.  A read that finishes before its cancel lands completes
+     normally; the cancels' own completions carry CANCEL_TAG.  */
+  const uint64_t CANCEL_TAG = UINT64_MAX;
+  if (in_flight > 0)
+    {
+      for (size_t s = 0; s < depth; s++)
+        if (fds[s] >= 0)
+          {
+            io_uring_sqe* sqe = io_uring_get_sqe (&ring);
+            if (!sqe)
+              break;
+            io_uring_prep_cancel64 (sqe, reading[s], 0);
+            io_uring_sqe_set_data64 (sqe, CANCEL_TAG);
+          }
+      io_uring_submit (&ring);
+    }
+
+  while (in_flight > 0)
+    {
+      io_uring_cqe* cqe;
+      int rc = io_uring_wait_cqe (&ring, &cqe);
+      if (rc == -EINTR)
+        continue;
+      if (rc < 0)
+        break;
+      if (io_uring_cqe_get_data64 (cqe) != CANCEL_TAG)
+        in_flight--;
+      io_uring_cqe_seen (&ring, cqe);
+    }
+
+  for (int fd : fds)
+    if (fd >= 0)
+      close (fd);
+}
+
+#else
+
+void
+PrefetchReader::fetch_loop ()
+{
+}
+
+#endif
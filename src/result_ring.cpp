@@ -0,0 +1,448 @@
+#include "result_ring.h"
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert (ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+               "the ring needs lock-free atomics in shared memory");
+
+static const char RING_MAGIC[4] = { 'W', 'I', 'R', 'R' };
+
+static const size_t COLUMN_BYTES[COLUMN_COUNT] = {
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 1, 1, 1
+};
+
+static size_t
+align64 (size_t n)
+{
+  return (n + 63) & ~(size_t)63;
+}
+
+static size_t
+column_offset (uint32_t max_defects, int column)
+{
+  size_t offset = align64 (sizeof (SlotHeader));
+  for (int c = 0; c < column; c++)
+    offset += align64 (COLUMN_BYTES[c] * max_defects);
+  return offset;
+}
+
+static size_t
+slot_bytes (const RingLayout& layout)
+{
+  return align64 (column_offset (layout.max_defects, COLUMN_COUNT)
+                  + layout.display_bytes);
+}
+
+static size_t
+header_bytes ()
+{
+  return align64 (sizeof (RingHeader));
+}
+
+class SharedSegment
+{
+public:
+  static SharedSegment*
+  create (const std::string& name, size_t size)
+  {
+    auto s = new SharedSegment ();
+#ifdef _WIN32
+    s->mapping_ = CreateFileMappingA (INVALID_HANDLE_VALUE, nullptr,
+                                      PAGE_READWRITE,
+                                      (DWORD)((uint64_t)size >> 32),
+                                      (DWORD)size, name.c_str ());
+    /* While any process still maps NAME, CreateFileMapping hands back
+       that mapping at its old size instead of a new one.  It is reused
+       only when it holds SIZE bytes; a smaller one leaves the segment
+       closed rather than mapping past its end.  */
+    bool existed = s->mapping_ && GetLastError () == ERROR_ALREADY_EXISTS;
+    if (s->mapping_)
+      s->data_ = (uchar*)MapViewOfFile (s->mapping_, FILE_MAP_ALL_ACCESS,
+                                        0, 0, existed ? 0 : size);
+    MEMORY_BASIC_INFORMATION info;
+    if (existed && s->data_
+        && (!VirtualQuery (s->data_, &info, sizeof (info))
+            || info.RegionSize < size))
+      {
+        UnmapViewOfFile (s->data_);
+        s->data_ = nullptr;
+      }
+#else
+    s->name_ = posix_name (name);
+    shm_unlink (s->name_.c_str ());
+    int fd = shm_open (s->name_.c_str (), O_CREAT | O_RDWR, 0644);
+    if (fd >= 0)
+      {
+        if (ftruncate (fd, (off_t)size) == 0)
+          {
+            void* p = mmap (nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+              s->data_ = (uchar*)p;
+          }
+        close (fd);
+      }
+    s->owner_ = true;
+#endif
+    s->size_ = s->data_ ? size : 0;
+    return s;
+  }
+
+  static SharedSegment*
+  open (const std::string& name, bool writable = false)
+  {
+    auto s = new SharedSegment ();
+#ifdef _WIN32
+    DWORD access = writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ;
+    s->mapping_ = OpenFileMappingA (access, FALSE, name.c_str ());
+    if (s->mapping_)
+      s->data_ = (uchar*)MapViewOfFile (s->mapping_, access, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION info;
+    if (s->data_ && VirtualQuery (s->data_, &info, sizeof (info)))
+      s->size_ = info.RegionSize;
+#else
+    s->name_ = posix_name (name);
+    int fd = shm_open (s->name_.c_str (), writable ? O_RDWR : O_RDONLY, 0);
+    struct stat st;
+    if (fd >= 0 && fstat (fd, &st) == 0 && st.st_size > 0)
+      {
+        int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void* p = mmap (nullptr, st.st_size, prot, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+          {
+            s->data_ = (uchar*)p;
+            s->size_ = (size_t)st.st_size;
+          }
+      }
+    if (fd >= 0)
+      close (fd);
+#endif
+    return s;
+  }
+
+  ~SharedSegment ()
+  {
+#ifdef _WIN32
+    if (data_)
+      UnmapViewOfFile (data_);
+    if (mapping_)
+      CloseHandle (mapping_);
+#else
+    if (data_)
+      munmap (data_, size_);
+    if (owner_)
+      shm_unlink (name_.c_str ());
+#endif
+  }
+
+  uchar*
+  data () const
+  {
+    return data_;
+  }
+
+  size_t
+  size () const
+  {
+    return size_;
+  }
+
+private:
+  SharedSegment () = default;
+
+#ifndef _WIN32
+  static std::string
+  posix_name (const std::string& name)
+  {
+    return (!name.empty () && name[0] == '/') ? name : "/" + name;
+  }
+
+  std::string name_;
+  bool owner_ = false;
+#else
+  HANDLE mapping_ = nullptr;
+#endif
+  uchar* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/* The ring header at BASE, or null when SIZE bytes do not hold one of
+   this version.  */
+static RingHeader*
+ring_header (uchar* base, size_t size)
+{
+  if (!base || size < header_bytes ())
+    return nullptr;
+
+  auto header = (RingHeader*)base;
+  if (std::memcmp (header->magic, RING_MAGIC, 4) != 0
+      || header->version != RING_VERSION)
+    return nullptr;
+  return header;
+}
+
+/* Tells readers of the segment at BASE that no more results will come.  */
+static void
+retire (uchar* base, size_t size)
+{
+  RingHeader* header = ring_header (base, size);
+  if (header)
+    header->alive.store (0, std::memory_order_release);
+}
+
+static int8_t
+type_code (const std::string& type)
+{
+  return (type == "scratch") ? 1 : (type == "cluster") ? 2 : 0;
+}
+
+ResultPublisher::ResultPublisher (const std::string& name,
+                                  const RingLayout& layout)
+{
+  CV_Assert (layout.slots > 0);
+
+  size_t size = header_bytes () + layout.slots * slot_bytes (layout);
+
+  /* A previous publisher's segment is replaced (POSIX) or reused
+     (Windows); either way its readers must learn that it is gone.  */
+  SharedSegment* previous = SharedSegment::open (name, true);
+  retire (previous->data (), previous->size ());
+  delete previous;
+
+  segment_ = SharedSegment::create (name, size);
+  if (!segment_->data ())
+    return;
+
+  uchar* base = segment_->data ();
+  auto header = new (base) RingHeader ();
+  std::memcpy (header->magic, RING_MAGIC, 4);
+  header->version = RING_VERSION;
+  header->slots = layout.slots;
+  header->max_defects = layout.max_defects;
+  header->slot_bytes = slot_bytes (layout);
+  header->display_bytes = layout.display_bytes;
+  header->epoch = (uint64_t)cv::getTickCount ();
+  header->published.store (0);
+
+  for (uint32_t i = 0; i < layout.slots; i++)
+    {
+      auto slot = new (base + header_bytes () + i * header->slot_bytes)
+        SlotHeader ();
+      slot->state.store (0);
+    }
+
+  /* Published last, so a reader that sees the segment alive also sees
+     the header and slots initialised.  */
+  header->alive.store (1, std::memory_order_release);
+}
+
+ResultPublisher::~ResultPublisher ()
+{
+  retire (segment_->data (), segment_->size ());
+  delete segment_;
+}
+
+bool
+ResultPublisher::is_open () const
+{
+  return segment_->data () != nullptr;
+}
+
+uint64_t
+ResultPublisher::publish (const InspectionResult& result,
+                          const cv::Mat& display, uint64_t wafer_id)
+{
+  if (!is_open ())
+    return 0;
+
+  uchar* base = segment_->data ();
+  auto header = (RingHeader*)base;
+  uint64_t sequence = header->published.load (std::memory_order_relaxed) + 1;
+
+  uchar* slot = base + header_bytes ()
+                + ((sequence - 1) % header->slots) * header->slot_bytes;
+  auto sh = (SlotHeader*)slot;
+
+  sh->state.store (2 * sequence - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence (std::memory_order_release);
+
+  uint32_t max = header->max_defects;
+  const std::vector<Defect>& defects = result.all_defects ();
+  uint32_t n = (uint32_t)std::min<size_t> (defects.size (), max);
+
+  sh->sequence = sequence;
+  sh->wafer_id = wafer_id;
+  sh->time_us = (int64_t)(cv::getTickCount () * 1e6
+                          / cv::getTickFrequency ());
+  sh->pass = result.pass;
+  sh->ratio = result.ratio;
+  sh->total_defects = (uint32_t)defects.size ();
+  sh->defect_count = n;
+
+  auto column = [&] (int c) { return slot + column_offset (max, c); };
+  auto f = [&] (int c) { return (float*)column (c); };
+  auto i32 = [&] (int c) { return (int32_t*)column (c); };
+  auto i8 = [&] (int c) { return (int8_t*)column (c); };
+
+  for (uint32_t i = 0; i < n; i++)
+    {
+      const Defect& d = defects[i];
+      f (COLUMN_CENTER_X)[i] = d.center.x;
+      f (COLUMN_CENTER_Y)[i] = d.center.y;
+      i32 (COLUMN_BOX_X)[i] = d.boundingBox.x;
+      i32 (COLUMN_BOX_Y)[i] = d.boundingBox.y;
+      i32 (COLUMN_BOX_WIDTH)[i] = d.boundingBox.width;
+      i32 (COLUMN_BOX_HEIGHT)[i] = d.boundingBox.height;
+      f (COLUMN_AREA)[i] = d.area;
+      f (COLUMN_ASPECT_RATIO)[i] = d.ar;
+      f (COLUMN_LENGTH)[i] = d.length;
+      f (COLUMN_WIDTH)[i] = d.width;
+      f (COLUMN_CURVATURE)[i] = d.curvature;
+      i8 (COLUMN_TYPE)[i] = type_code (d.type);
+      i8 (COLUMN_POLARITY)[i] = (d.polarity == "dark") ? 1 : 0;
+      i8 (COLUMN_ZONE)[i] = (int8_t)d.zone;
+    }
+
+  size_t display_size = display.total () * display.elemSize ();
+  bool fits = !display.empty () && display.depth () == CV_8U
+              && display_size <= header->display_bytes;
+  sh->display_rows = fits ? display.rows : 0;
+  sh->display_cols = fits ? display.cols : 0;
+  sh->display_type = fits ? display.type () : 0;
+  if (fits)
+    {
+      cv::Mat dst (display.size (), display.type (),
+                   column (COLUMN_COUNT));
+      display.copyTo (dst);
+    }
+
+  sh->state.store (2 * sequence, std::memory_order_release);
+  header->published.store (sequence, std::memory_order_release);
+
+  return sequence;
+}
+
+bool
+ResultView::valid () const
+{
+  std::atomic_thread_fence (std::memory_order_acquire);
+  return slot_state
+         && slot_state->load (std::memory_order_relaxed) == 2 * sequence;
+}
+
+ResultSubscriber::ResultSubscriber (const std::string& name)
+  : name_ (name), segment_ (SharedSegment::open (name))
+{
+  if (is_open ())
+    epoch_ = ((const RingHeader*)segment_->data ())->epoch;
+}
+
+ResultSubscriber::~ResultSubscriber ()
+{
+  delete segment_;
+}
+
+bool
+ResultSubscriber::is_open () const
+{
+  const RingHeader* header = ring_header (segment_->data (),
+                                          segment_->size ());
+  return header
+         && segment_->size () >= header_bytes ()
+                                 + header->slots * header->slot_bytes;
+}
+
+bool
+ResultSubscriber::retired () const
+{
+  if (!is_open ())
+    return true;
+
+  auto header = (const RingHeader*)segment_->data ();
+  return header->alive.load (std::memory_order_acquire) == 0
+         || header->epoch != epoch_;
+}
+
+bool
+ResultSubscriber::reopen ()
+{
+  delete segment_;
+  segment_ = SharedSegment::open (name_);
+  epoch_ = is_open () ? ((const RingHeader*)segment_->data ())->epoch : 0;
+  return is_open ();
+}
+
+uint64_t
+ResultSubscriber::latest () const
+{
+  if (!is_open ())
+    return 0;
+
+  auto header = (const RingHeader*)segment_->data ();
+  return header->published.load (std::memory_order_acquire);
+}
+
+bool
+ResultSubscriber::view (uint64_t sequence, ResultView& out) const
+{
+  if (!is_open () || sequence == 0)
+    return false;
+
+  const uchar* base = segment_->data ();
+  auto header = (const RingHeader*)base;
+  const uchar* slot = base + header_bytes ()
+                      + ((sequence - 1) % header->slots) * header->slot_bytes;
+  auto sh = (const SlotHeader*)slot;
+
+  if (sh->state.load (std::memory_order_acquire) != 2 * sequence)
+    return false;
+
+  uint32_t max = header->max_defects;
+  auto column = [&] (int c) { return slot + column_offset (max, c); };
+
+  out.sequence = sequence;
+  out.slot_state = &sh->state;
+  out.wafer_id = sh->wafer_id;
+  out.time_us = sh->time_us;
+  out.pass = sh->pass != 0;
+  out.ratio = sh->ratio;
+  out.total_defects = sh->total_defects;
+  out.defect_count = std::min (sh->defect_count, max);
+  out.center_x = (const float*)column (COLUMN_CENTER_X);
+  out.center_y = (const float*)column (COLUMN_CENTER_Y);
+  out.box_x = (const int32_t*)column (COLUMN_BOX_X);
+  out.box_y = (const int32_t*)column (COLUMN_BOX_Y);
+  out.box_width = (const int32_t*)column (COLUMN_BOX_WIDTH);
+  out.box_height = (const int32_t*)column (COLUMN_BOX_HEIGHT);
+  out.area = (const float*)column (COLUMN_AREA);
+  out.aspect_ratio = (const float*)column (COLUMN_ASPECT_RATIO);
+  out.length = (const float*)column (COLUMN_LENGTH);
+  out.width = (const float*)column (COLUMN_WIDTH);
+  out.curvature = (const float*)column (COLUMN_CURVATURE);
+  out.type = (const int8_t*)column (COLUMN_TYPE);
+  out.polarity = (const int8_t*)column (COLUMN_POLARITY);
+  out.zone = (const int8_t*)column (COLUMN_ZONE);
+
+  int rows = sh->display_rows;
+  int cols = sh->display_cols;
+  int type = sh->display_type;
+  bool has_display = rows > 0 && cols > 0
+                     && (size_t)rows * cols * CV_ELEM_SIZE (type)
+                        <= header->display_bytes;
+  out.display = has_display
+    ? cv::Mat (rows, cols, type, (void*)column (COLUMN_COUNT))
+    : cv::Mat ();
+
+  /* The scalars above must come from one publication too.  */
+  return out.valid ();
+}
@@ -0,0 +1,387 @@
+#include "stage_cache.h"
+#include "tile_archive.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Read-only mapping of a whole file; empty when it cannot be mapped.  */
+class MappedFile
+{
+public:
+  explicit MappedFile (const std::string& path)
+  {
+#ifdef _WIN32
+    file_ = CreateFileA (path.c_str (), GENERIC_READ, FILE_SHARE_READ,
+                         nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                         nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+      return;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx (file_, &size) || size.QuadPart == 0)
+      return;
+    mapping_ = CreateFileMappingA (file_, nullptr, PAGE_READONLY, 0, 0,
+                                   nullptr);
+    if (!mapping_)
+      return;
+    data_ = (const uchar*)MapViewOfFile (mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (data_)
+      size_ = (size_t)size.QuadPart;
+#else
+    int fd = open (path.c_str (), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat (fd, &st) == 0 && st.st_size > 0)
+      {
+        void* p = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+          {
+            data_ = (const uchar*)p;
+            size_ = (size_t)st.st_size;
+          }
+      }
+    close (fd);
+#endif
+  }
+
+  ~MappedFile ()
+  {
+#ifdef _WIN32
+    if (data_)
+      UnmapViewOfFile (data_);
+    if (mapping_)
+      CloseHandle (mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle (file_);
+#else
+    if (data_)
+      munmap ((void*)data_, size_);
+#endif
+  }
+
+  MappedFile (const MappedFile&) = delete;
+  MappedFile& operator= (const MappedFile&) = delete;
+
+  const uchar*
+  data () const
+  {
+    return data_;
+  }
+
+  size_t
+  size () const
+  {
+    return size_;
+  }
+
+private:
+  const uchar* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#endif
+};
+
+static const char* INDEX_NAME = "stage_cache.yml";
+static const double INDEX_SAVE_SECONDS = 10.0;
+
+static uint64
+fnv1a (const std::string& s)
+{
+  uint64 h = 1469598103934665603ULL;
+  for (unsigned char ch : s)
+    {
+      h ^= ch;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+static uint64
+mix (uint64 h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* 64-bit hash of the pixels, eight bytes per step on fixed 64-row bands
+   hashed in parallel and combined in order, so the value does not
+   depend on the thread count.  */
+static uint64
+content_hash (const cv::Mat& image)
+{
+  const int band = 64;
+  int bands = (image.rows + band - 1) / band;
+  size_t row_bytes = image.cols * image.elemSize ();
+  std::vector<uint64> hashes (bands);
+
+  cv::parallel_for_ (cv::Range (0, bands), [&] (const cv::Range& range)
+    {
+      for (int b = range.start; b < range.end; b++)
+        {
+          uint64 h = 0x9e3779b97f4a7c15ULL * (b + 1);
+          int end = std::min ((b + 1) * band, image.rows);
+          for (int y = b * band; y < end; y++)
+            {
+              const uchar* p = image.ptr (y);
+              size_t x = 0;
+              for (; x + 8 <= row_bytes; x += 8)
+                {
+                  uint64 w;
+                  std::memcpy (&w, p + x, 8);
+                  h = (h ^ w) * 0x100000001b3ULL;
+                  h ^= h >> 29;
+                }
+              for (; x < row_bytes; x++)
+                h = (h ^ p[x]) * 0x100000001b3ULL;
+            }
+          hashes[b] = h;
+        }
+    });
+
+  uint64 h = mix ((uint64)image.rows << 32 | (uint32_t)image.cols)
+             ^ (uint64)image.type ();
+  for (uint64 v : hashes)
+    h = mix (h ^ v);
+  return h;
+}
+
+std::string
+StageCache::key (const cv::Mat& gray, const IlluminationParams& params)
+{
+  std::string p = cv::format ("%d %d %d %d %d %d %.9g %.9g",
+                              (int)params.estimator, params.blur_size,
+                              (int)params.decimated_blur, params.poly_degree,
+                              params.median_downsample,
+                              (int)params.normalization,
+                              params.low_percentile, params.high_percentile);
+
+  uint64 content = content_hash (gray);
+  return cv::format ("%08x%08x_%08x", (unsigned)(content >> 32),
+                     (unsigned)content, (unsigned)mix (fnv1a (p)));
+}
+
+/* Writes DATA to PATH, removing it again on failure.  */
+static bool
+write_file (const std::string& path, const std::vector<uchar>& data)
+{
+  std::ofstream out (path, std::ios::binary | std::ios::trunc);
+  out.write ((const char*)data.data (), data.size ());
+  if (out)
+    return true;
+  out.close ();
+  std::remove (path.c_str ());
+  return false;
+}
+
+static size_t
+file_size (const std::string& path)
+{
+  std::ifstream in (path, std::ios::binary | std::ios::ate);
+  return in ? (size_t)in.tellg () : 0;
+}
+
+StageCache::StageCache (const std::string& directory, size_t max_bytes)
+  : directory_ (directory), max_bytes_ (max_bytes),
+    index_saved_ (cv::getTickCount ())
+{
+  cv::FileStorage fs (directory_ + "/" + INDEX_NAME,
+                      cv::FileStorage::READ);
+  if (!fs.isOpened ())
+    return;
+
+  for (const auto& node : fs["entries"])
+    {
+      std::string k = (std::string)node["key"];
+      size_t bytes = (size_t)(double)node["bytes"];
+      if (k.empty () || entries_.count (k))
+        continue;
+
+      Entry e;
+      e.bytes = bytes;
+      e.position = order_.insert (order_.end (), k);
+      entries_[k] = e;
+      bytes_ += bytes;
+    }
+}
+
+StageCache::~StageCache ()
+{
+  std::lock_guard<std::mutex> guard (lock_);
+  if (index_dirty_)
+    save_index_locked ();
+}
+
+size_t
+StageCache::bytes () const
+{
+  std::lock_guard<std::mutex> guard (lock_);
+  return bytes_;
+}
+
+std::string
+StageCache::entry_path (const std::string& key, const char* suffix) const
+{
+  return directory_ + "/" + key + suffix;
+}
+
+void
+StageCache::erase_locked (const std::string& key)
+{
+  auto it = entries_.find (key);
+  if (it == entries_.end ())
+    return;
+
+  std::remove (entry_path (key, ".mask.png").c_str ());
+  std::remove (entry_path (key, ".corrected.wta").c_str ());
+  bytes_ -= it->second.bytes;
+  order_.erase (it->second.position);
+  entries_.erase (it);
+}
+
+void
+StageCache::save_index_locked ()
+{
+  index_dirty_ = false;
+  index_saved_ = cv::getTickCount ();
+
+  std::string path = directory_ + "/" + INDEX_NAME;
+  std::string temp = unique_temp_path (path);
+  {
+    cv::FileStorage fs (temp, cv::FileStorage::WRITE
+                              | cv::FileStorage::FORMAT_YAML);
+    if (!fs.isOpened ())
+      return;
+
+    fs << "entries" << "[";
+    for (const auto& k : order_)
+      fs << "{" << "key" << k
+         << "bytes" << (double)entries_.at (k).bytes << "}";
+    fs << "]";
+  }
+  replace_file (temp, path);
+}
+
+bool
+StageCache::load (const std::string& key, cv::Mat& mask, cv::Mat& corrected)
+{
+  {
+    std::lock_guard<std::mutex> guard (lock_);
+    auto it = entries_.find (key);
+    if (it == entries_.end ())
+      return false;
+    order_.splice (order_.end (), order_, it->second.position);
+  }
+
+  MappedFile mask_file (entry_path (key, ".mask.png"));
+  MappedFile corrected_file (entry_path (key, ".corrected.wta"));
+
+  bool ok = mask_file.data () && corrected_file.data ();
+  if (ok)
+    {
+      mask = cv::imdecode (cv::Mat (1, (int)mask_file.size (), CV_8U,
+                                    (void*)mask_file.data ()),
+                           cv::IMREAD_GRAYSCALE);
+      ok = !mask.empty ()
+           && decode_tile_archive (corrected_file.data (),
+                                   corrected_file.size (), corrected)
+           && corrected.size () == mask.size ();
+    }
+
+  /* A removal is persisted right away.  A hit only moves the entry in
+     the LRU order; that is written with the next store, by the first
+     hit INDEX_SAVE_SECONDS after the last write, or on destruction, so
+     entries read before a restart are not the first to be evicted
+     after it, without an index rewrite per hit.  */
+  std::lock_guard<std::mutex> guard (lock_);
+  if (!ok)
+    erase_locked (key);
+  index_dirty_ = true;
+  double since = (cv::getTickCount () - index_saved_)
+                 / cv::getTickFrequency ();
+  if (!ok || since >= INDEX_SAVE_SECONDS)
+    save_index_locked ();
+  return ok;
+}
+
+void
+StageCache::store (const std::string& key, const cv::Mat& mask,
+                   const cv::Mat& corrected)
+{
+  std::string mask_path = entry_path (key, ".mask.png");
+  std::string corrected_path = entry_path (key, ".corrected.wta");
+
+  /* Both files are written aside and renamed into place only once both
+     exist, so a failure removes nothing but this call's temporaries,
+     never the files of an entry another thread stored meanwhile.  */
+  std::string mask_temp = unique_temp_path (mask_path);
+  std::string corrected_temp = unique_temp_path (corrected_path);
+
+  std::vector<uchar> png;
+  if (!cv::imencode (".png", mask, png) || !write_file (mask_temp, png))
+    return;
+  if (!write_tile_archive (corrected_temp, corrected))
+    {
+      std::remove (mask_temp.c_str ());
+      return;
+    }
+  size_t bytes = file_size (mask_temp) + file_size (corrected_temp);
+  if (!replace_file (mask_temp, mask_path))
+    {
+      std::remove (corrected_temp.c_str ());
+      return;
+    }
+  if (!replace_file (corrected_temp, corrected_path))
+    return;
+
+  std::lock_guard<std::mutex> guard (lock_);
+  if (entries_.count (key))
+    {
+      /* Another thread stored the same stages; keep its accounting.  */
+      order_.splice (order_.end (), order_, entries_[key].position);
+      save_index_locked ();
+      return;
+    }
+
+  Entry e;
+  e.bytes = bytes;
+  e.position = order_.insert (order_.end (), key);
+  entries_[key] = e;
+  bytes_ += bytes;
+
+  while (bytes_ > max_bytes_ && order_.size () > 1)
+    erase_locked (order_.front ());
+
+  save_index_locked ();
+}
+
+void
+inspect_cached (const cv::Mat& gray, const Recipe& recipe, StageCache& cache,
+                InspectionResult& result)
+{
+  std::string key = StageCache::key (gray, recipe.illumination);
+  if (!cache.load (key, result.mask, result.corrected))
+    {
+      result.mask = extract_lens_mask (gray);
+      correct_illumination (gray, result.mask, recipe.illumination,
+                            result.corrected);
+      cache.store (key, result.mask, result.corrected);
+    }
+
+  inspect_corrected (recipe, result);
+}
@@ -0,0 +1,537 @@
+#include "tile_archive.h"
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+
+#if defined(WAFER_WITH_ZSTD)
+#include <zstd.h>
+#elif defined(WAFER_WITH_LZ4)
+#include <lz4.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+enum TileCodec : uint32_t
+{
+  CODEC_PNG = 0,
+  CODEC_ZSTD = 1,
+  CODEC_LZ4 = 2
+};
+
+#if defined(WAFER_WITH_ZSTD)
+static const uint32_t WRITE_CODEC = CODEC_ZSTD;
+#elif defined(WAFER_WITH_LZ4)
+static const uint32_t WRITE_CODEC = CODEC_LZ4;
+#else
+static const uint32_t WRITE_CODEC = CODEC_PNG;
+#endif
+
+static const char MAGIC[4] = { 'W', 'T', 'A', '1' };
+static const size_t HEADER_SIZE = 32;
+static const size_t INDEX_ENTRY_SIZE = 16;
+
+/* Header: magic, codec, width, height, tile width, tile height, tile
+   count, reserved; then per tile its u64 offset, u32 size, u32 reserved;
+   then the tile data.  */
+struct ArchiveIndex
+{
+  uint32_t codec = 0;
+  cv::Size size;
+  cv::Size tile;
+  int across = 0;
+  std::vector<uint64_t> offsets;
+  std::vector<uint32_t> sizes;
+
+  cv::Rect
+  tile_rect (int i) const
+  {
+    cv::Rect r (i % across * tile.width, i / across * tile.height,
+                tile.width, tile.height);
+    return r & cv::Rect (cv::Point (), size);
+  }
+};
+
+static void
+put_u32 (uchar* p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = (uchar)(v >> (8 * i));
+}
+
+static void
+put_u64 (uchar* p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++)
+    p[i] = (uchar)(v >> (8 * i));
+}
+
+static uint32_t
+get_u32 (const uchar* p)
+{
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t
+get_u64 (const uchar* p)
+{
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static std::vector<uchar>
+compress_tile (const cv::Mat& tile)
+{
+  std::vector<uchar> out;
+
+#if defined(WAFER_WITH_ZSTD) || defined(WAFER_WITH_LZ4)
+  cv::Mat packed = tile.isContinuous () ? tile : tile.clone ();
+  size_t raw = packed.total ();
+#endif
+
+#if defined(WAFER_WITH_ZSTD)
+  out.resize (ZSTD_compressBound (raw));
+  size_t n = ZSTD_compress (out.data (), out.size (), packed.data, raw, 1);
+  out.resize (ZSTD_isError (n) ? 0 : n);
+#elif defined(WAFER_WITH_LZ4)
+  out.resize (LZ4_compressBound ((int)raw));
+  int n = LZ4_compress_default ((const char*)packed.data, (char*)out.data (),
+                                (int)raw, (int)out.size ());
+  out.resize (n > 0 ? n : 0);
+#else
+  cv::imencode (".png", tile, out, { cv::IMWRITE_PNG_COMPRESSION, 1 });
+#endif
+
+  return out;
+}
+
+/* Decodes SIZE bytes at DATA into DST, a CV_8U Mat of the tile's
+   size.  */
+static bool
+decompress_tile (uint32_t codec, const uchar* data, size_t size, cv::Mat& dst)
+{
+  size_t raw = dst.total ();
+
+  switch (codec)
+    {
+    case CODEC_PNG:
+      {
+        /* imdecode throws on an empty buffer.  */
+        if (size == 0)
+          return false;
+        cv::Mat tile = cv::imdecode (cv::Mat (1, (int)size, CV_8U,
+                                              (void*)data),
+                                     cv::IMREAD_GRAYSCALE);
+        if (tile.size () != dst.size ())
+          return false;
+        tile.copyTo (dst);
+        return true;
+      }
+#if defined(WAFER_WITH_ZSTD)
+    case CODEC_ZSTD:
+      return dst.isContinuous ()
+             && ZSTD_decompress (dst.data, raw, data, size) == raw;
+#endif
+#if defined(WAFER_WITH_LZ4)
+    case CODEC_LZ4:
+      return dst.isContinuous ()
+             && LZ4_decompress_safe ((const char*)data, (char*)dst.data,
+                                     (int)size, (int)raw) == (int)raw;
+#endif
+    default:
+      (void)raw;
+      return false;
+    }
+}
+
+std::string
+unique_temp_path (const std::string& path)
+{
+  static std::atomic<unsigned> counter (0);
+#ifdef _WIN32
+  unsigned long pid = (unsigned long)GetCurrentProcessId ();
+#else
+  unsigned long pid = (unsigned long)getpid ();
+#endif
+  return cv::format ("%s.%lu.%u.tmp", path.c_str (), pid, counter++);
+}
+
+bool
+replace_file (const std::string& temp, const std::string& path)
+{
+#ifdef _WIN32
+  /* std::rename does not replace an existing file on Windows.  */
+  if (MoveFileExA (temp.c_str (), path.c_str (), MOVEFILE_REPLACE_EXISTING))
+    return true;
+#else
+  if (std::rename (temp.c_str (), path.c_str ()) == 0)
+    return true;
+#endif
+  std::remove (temp.c_str ());
+  return false;
+}
+
+static bool
+write_archive (const std::string& path, const cv::Mat& gray,
+               cv::Size tile_size, bool parallel)
+{
+  CV_Assert (gray.type () == CV_8U && tile_size.area () > 0);
+
+  ArchiveIndex index;
+  index.size = gray.size ();
+  index.tile = tile_size;
+  index.across = (gray.cols + tile_size.width - 1) / tile_size.width;
+  int down = (gray.rows + tile_size.height - 1) / tile_size.height;
+  int count = index.across * down;
+
+  std::vector<std::vector<uchar>> tiles (count);
+  auto compress = [&] (const cv::Range& range)
+    {
+      for (int i = range.start; i < range.end; i++)
+        tiles[i] = compress_tile (gray (index.tile_rect (i)));
+    };
+  if (parallel)
+    cv::parallel_for_ (cv::Range (0, count), compress);
+  else
+    compress (cv::Range (0, count));
+
+  std::vector<uchar> head (HEADER_SIZE + INDEX_ENTRY_SIZE * count, 0);
+  std::copy (MAGIC, MAGIC + 4, head.begin ());
+  put_u32 (&head[4], WRITE_CODEC);
+  put_u32 (&head[8], gray.cols);
+  put_u32 (&head[12], gray.rows);
+  put_u32 (&head[16], tile_size.width);
+  put_u32 (&head[20], tile_size.height);
+  put_u32 (&head[24], count);
+
+  uint64_t offset = head.size ();
+  for (int i = 0; i < count; i++)
+    {
+      if (tiles[i].empty ())
+        return false;
+      uchar* entry = &head[HEADER_SIZE + INDEX_ENTRY_SIZE * i];
+      put_u64 (entry, offset);
+      put_u32 (entry + 8, (uint32_t)tiles[i].size ());
+      offset += tiles[i].size ();
+    }
+
+  /* Written aside and renamed, so a reader never sees half an archive.  */
+  std::string temp = unique_temp_path (path);
+  {
+    std::ofstream out (temp, std::ios::binary | std::ios::trunc);
+    out.write ((const char*)head.data (), head.size ());
+    for (const auto& t : tiles)
+      out.write ((const char*)t.data (), t.size ());
+    if (!out)
+      {
+        out.close ();
+        std::remove (temp.c_str ());
+        return false;
+      }
+  }
+
+  return replace_file (temp, path);
+}
+
+bool
+write_tile_archive (const std::string& path, const cv::Mat& gray,
+                    cv::Size tile_size)
+{
+  return write_archive (path, gray, tile_size, true);
+}
+
+/* Fills INDEX from the fixed header at HEAD; COUNT gets the number of
+   index entries that follow.  */
+static bool
+parse_header (const uchar* head, ArchiveIndex& index, uint32_t& count)
+{
+  if (!std::equal (MAGIC, MAGIC + 4, (const char*)head))
+    return false;
+
+  index.codec = get_u32 (head + 4);
+  index.size = { (int)get_u32 (head + 8), (int)get_u32 (head + 12) };
+  index.tile = { (int)get_u32 (head + 16), (int)get_u32 (head + 20) };
+  count = get_u32 (head + 24);
+  if (index.size.area () <= 0 || index.tile.area () <= 0)
+    return false;
+
+  index.across = (index.size.width + index.tile.width - 1) / index.tile.width;
+  int down = (index.size.height + index.tile.height - 1) / index.tile.height;
+  return count == (uint32_t)(index.across * down);
+}
+
+static void
+parse_entries (const uchar* entries, uint32_t count, ArchiveIndex& index)
+{
+  index.offsets.resize (count);
+  index.sizes.resize (count);
+  for (uint32_t i = 0; i < count; i++)
+    {
+      index.offsets[i] = get_u64 (entries + INDEX_ENTRY_SIZE * i);
+      index.sizes[i] = get_u32 (entries + INDEX_ENTRY_SIZE * i + 8);
+    }
+}
+
+/* True when every tile is non-empty and lies after the index and
+   within the FILE_SIZE bytes of the archive.  */
+static bool
+valid_entries (const ArchiveIndex& index, uint64_t file_size)
+{
+  uint64_t data_start = HEADER_SIZE
+                        + INDEX_ENTRY_SIZE * (uint64_t)index.offsets.size ();
+  for (size_t i = 0; i < index.offsets.size (); i++)
+    if (index.sizes[i] == 0 || index.offsets[i] < data_start
+        || index.offsets[i] > file_size
+        || index.sizes[i] > file_size - index.offsets[i])
+      return false;
+  return true;
+}
+
+static bool
+read_index (std::ifstream& in, ArchiveIndex& index)
+{
+  if (!in.seekg (0, std::ios::end))
+    return false;
+  uint64_t file_size = (uint64_t)in.tellg ();
+  in.seekg (0);
+
+  uchar head[HEADER_SIZE];
+  uint32_t count = 0;
+  if (!in.read ((char*)head, HEADER_SIZE)
+      || !parse_header (head, index, count))
+    return false;
+
+  std::vector<uchar> entries (INDEX_ENTRY_SIZE * count);
+  if (!in.read ((char*)entries.data (), entries.size ()))
+    return false;
+
+  parse_entries (entries.data (), count, index);
+  return valid_entries (index, file_size);
+}
+
+static bool
+read_tile (std::ifstream& in, const ArchiveIndex& index, int i,
+           std::vector<uchar>& buffer, cv::Mat& dst)
+{
+  buffer.resize (index.sizes[i]);
+  in.seekg ((std::streamoff)index.offsets[i]);
+  if (!in.read ((char*)buffer.data (), buffer.size ()))
+    return false;
+
+  return decompress_tile (index.codec, buffer.data (), buffer.size (), dst);
+}
+
+cv::Size
+tile_archive_size (const std::string& path)
+{
+  std::ifstream in (path, std::ios::binary);
+  ArchiveIndex index;
+  return read_index (in, index) ? index.size : cv::Size ();
+}
+
+bool
+read_tile_archive (const std::string& path, const cv::Rect& roi,
+                   cv::Mat& crop)
+{
+  std::ifstream in (path, std::ios::binary);
+  ArchiveIndex index;
+  if (!read_index (in, index))
+    return false;
+
+  cv::Rect area = roi & cv::Rect (cv::Point (), index.size);
+  crop.create (area.size (), CV_8U);
+  if (area.empty ())
+    return true;
+
+  int x0 = area.x / index.tile.width;
+  int x1 = (area.br ().x - 1) / index.tile.width;
+  int y0 = area.y / index.tile.height;
+  int y1 = (area.br ().y - 1) / index.tile.height;
+
+  std::vector<uchar> buffer;
+  cv::Mat tile;
+  for (int ty = y0; ty <= y1; ty++)
+    for (int tx = x0; tx <= x1; tx++)
+      {
+        int i = ty * index.across + tx;
+        cv::Rect rect = index.tile_rect (i);
+        tile.create (rect.size (), CV_8U);
+        if (!read_tile (in, index, i, buffer, tile))
+          return false;
+
+        cv::Rect overlap = rect & area;
+        tile (overlap - rect.tl ()).copyTo (crop (overlap - area.tl ()));
+      }
+
+  return true;
+}
+
+bool
+decode_archive_tiles (const std::string& path, const TileSink& sink)
+{
+  ArchiveIndex index;
+  {
+    std::ifstream in (path, std::ios::binary);
+    if (!read_index (in, index))
+      return false;
+  }
+
+  int count = (int)index.offsets.size ();
+  std::vector<uchar> failed (count, 0);
+
+  cv::parallel_for_ (cv::Range (0, count), [&] (const cv::Range& range)
+    {
+      std::ifstream in (path, std::ios::binary);
+      std::vector<uchar> buffer;
+      cv::Mat tile;
+      for (int i = range.start; i < range.end; i++)
+        {
+          cv::Rect rect = index.tile_rect (i);
+          tile.create (rect.size (), CV_8U);
+          if (!read_tile (in, index, i, buffer, tile))
+            {
+              failed[i] = 1;
+              continue;
+            }
+          sink (rect, tile);
+        }
+    }, std::max (cv::getNumThreads (), 1));
+
+  return std::find (failed.begin (), failed.end (), 1) == failed.end ();
+}
+
+bool
+decode_tile_archive (const uchar* data, size_t size, cv::Mat& gray)
+{
+  ArchiveIndex index;
+  uint32_t count = 0;
+  if (size < HEADER_SIZE || !parse_header (data, index, count)
+      || size < HEADER_SIZE + INDEX_ENTRY_SIZE * count)
+    return false;
+
+  parse_entries (data + HEADER_SIZE, count, index);
+  if (!valid_entries (index, size))
+    return false;
+
+  gray.create (index.size, CV_8U);
+  std::vector<uchar> failed (count, 0);
+
+  cv::parallel_for_ (cv::Range (0, (int)count), [&] (const cv::Range& range)
+    {
+      cv::Mat tile;
+      for (int i = range.start; i < range.end; i++)
+        {
+          cv::Rect rect = index.tile_rect (i);
+          tile.create (rect.size (), CV_8U);
+          if (!decompress_tile (index.codec, data + index.offsets[i],
+                                index.sizes[i], tile))
+            failed[i] = 1;
+          else
+            tile.copyTo (gray (rect));
+        }
+    });
+
+  return std::find (failed.begin (), failed.end (), 1) == failed.end ();
+}
+
+static void
+lower_thread_priority ()
+{
+#ifdef _WIN32
+  SetThreadPriority (GetCurrentThread (), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+  /* On Linux nice values are per thread.  */
+  setpriority (PRIO_PROCESS, (id_t)syscall (SYS_gettid), 19);
+#endif
+}
+
+TileArchiveWriter::TileArchiveWriter (cv::Size tile_size)
+  : tile_size_ (tile_size)
+{
+  CV_Assert (tile_size.area () > 0);
+  thread_ = std::thread (&TileArchiveWriter::run, this);
+}
+
+TileArchiveWriter::~TileArchiveWriter ()
+{
+  {
+    std::lock_guard<std::mutex> guard (lock_);
+    stop_ = true;
+  }
+  changed_.notify_all ();
+  thread_.join ();
+}
+
+void
+TileArchiveWriter::submit (const std::string& path, const cv::Mat& gray)
+{
+  /* Checked here so a bad image fails in the caller, not on the writer
+     thread.  */
+  CV_Assert (gray.type () == CV_8U);
+
+  {
+    std::lock_guard<std::mutex> guard (lock_);
+    queue_.emplace_back (path, gray);
+  }
+  changed_.notify_all ();
+}
+
+int
+TileArchiveWriter::flush ()
+{
+  std::unique_lock<std::mutex> guard (lock_);
+  changed_.wait (guard, [&] { return queue_.empty () && !busy_; });
+
+  int failures = failures_;
+  failures_ = 0;
+  return failures;
+}
+
+void
+TileArchiveWriter::run ()
+{
+  lower_thread_priority ();
+
+  std::unique_lock<std::mutex> guard (lock_);
+  for (;;)
+    {
+      changed_.wait (guard, [&] { return stop_ || !queue_.empty (); });
+      if (queue_.empty ())
+        return;
+
+      auto job = std::move (queue_.front ());
+      queue_.pop_front ();
+      busy_ = true;
+      guard.unlock ();
+
+      /* An exception escaping this thread would terminate the
+         process; an archive that throws counts as failed.  */
+      bool ok = false;
+      try
+        {
+          ok = write_archive (job.first, job.second, tile_size_, false);
+        }
+      catch (...)
+        {
+        }
+
+      guard.lock ();
+      busy_ = false;
+      if (!ok)
+        failures_++;
+      changed_.notify_all ();
+    }
+}
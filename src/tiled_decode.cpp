@@ -0,0 +1,253 @@
+#include "tiled_decode.h"
+
+#ifdef WAFER_WITH_LIBTIFF
+#include <atomic>
+#include <tiffio.h>
+#endif
+
+static void
+deliver_in_tiles (const cv::Mat& gray, const TileSink& sink,
+                  cv::Size tile_size)
+{
+  int cols = (gray.cols + tile_size.width - 1) / tile_size.width;
+  int rows = (gray.rows + tile_size.height - 1) / tile_size.height;
+
+  cv::parallel_for_ (cv::Range (0, cols * rows), [&] (const cv::Range& range)
+    {
+      for (int i = range.start; i < range.end; i++)
+        {
+          cv::Rect roi (i % cols * tile_size.width,
+                        i / cols * tile_size.height,
+                        tile_size.width, tile_size.height);
+          roi &= cv::Rect (0, 0, gray.cols, gray.rows);
+          sink (roi, gray (roi));
+        }
+    });
+}
+
+#ifdef WAFER_WITH_LIBTIFF
+
+/* Layout of a TIFF's first directory, if it is one we decode.  A
+   striped file is described as tiles one strip high and the full image
+   wide.  */
+struct TiffLayout
+{
+  cv::Size size;
+  cv::Size tile;
+  int samples = 1;
+  bool tiled = false;
+  int across = 0;
+  int count = 0;
+};
+
+/* libtiff reports to stderr by default, and read_layout probes every
+   input, TIFF or not.  Failures reach the caller through return values
+   and the cv::imread fallback, so the messages are dropped.  Installed
+   once, before the first handle is opened.  */
+static void
+silence_libtiff ()
+{
+  static const bool installed = []
+    {
+      TIFFSetErrorHandler (nullptr);
+      TIFFSetWarningHandler (nullptr);
+      return true;
+    } ();
+  (void)installed;
+}
+
+static bool
+read_layout (const std::string& path, TiffLayout& layout)
+{
+  silence_libtiff ();
+
+  TIFF* tif = TIFFOpen (path.c_str (), "r");
+  if (!tif)
+    return false;
+
+  uint32_t w = 0, h = 0;
+  uint16_t bits = 0, samples = 1, planar = PLANARCONFIG_CONTIG;
+  uint16_t photometric = 0;
+  TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &w);
+  TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &h);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_BITSPERSAMPLE, &bits);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_PLANARCONFIG, &planar);
+  bool has_photometric
+    = TIFFGetField (tif, TIFFTAG_PHOTOMETRIC, &photometric) != 0;
+
+  /* Encoded samples are used as grey or RGB values as they are, so
+     palette, YCbCr (possibly subsampled), MinIsWhite and CMYK files are
+     left to cv::imread, which converts them.  */
+  bool plain = has_photometric
+               && ((samples == 1 && photometric == PHOTOMETRIC_MINISBLACK)
+                   || ((samples == 3 || samples == 4)
+                       && photometric == PHOTOMETRIC_RGB));
+
+  bool ok = bits == 8 && planar == PLANARCONFIG_CONTIG && plain
+            && w > 0 && h > 0;
+
+  layout.size = { (int)w, (int)h };
+  layout.samples = samples;
+  layout.tiled = TIFFIsTiled (tif);
+  if (layout.tiled)
+    {
+      uint32_t tw = 0, th = 0;
+      TIFFGetField (tif, TIFFTAG_TILEWIDTH, &tw);
+      TIFFGetField (tif, TIFFTAG_TILELENGTH, &th);
+      layout.tile = { (int)tw, (int)th };
+      layout.count = (int)TIFFNumberOfTiles (tif);
+    }
+  else
+    {
+      uint32_t rows = 0;
+      TIFFGetFieldDefaulted (tif, TIFFTAG_ROWSPERSTRIP, &rows);
+      layout.tile = { (int)w, (int)std::min (rows, h) };
+      layout.count = (int)TIFFNumberOfStrips (tif);
+    }
+  ok = ok && layout.tile.area () > 0;
+  if (ok)
+    layout.across = (layout.size.width + layout.tile.width - 1)
+                    / layout.tile.width;
+
+  TIFFClose (tif);
+  return ok;
+}
+
+/* Decodes every tile of PATH on all threads.  EMIT (roi, tile) gets the
+   decoded tile cropped to the image, with LAYOUT.samples channels.  For
+   a grey image INTO, when given, receives the tiles directly and EMIT
+   is not called.  libtiff writes a tile packed at the tile's width, so
+   only strips and tiles spanning the image's width decode in place;
+   narrower tiles go through a per-thread buffer and are copied into
+   their ROI.  Returns false if any tile failed.  */
+template <typename Emit>
+static bool
+decode_tiff (const std::string& path, const TiffLayout& layout, Emit emit,
+             cv::Mat* into = nullptr)
+{
+  bool grey_into = into && layout.samples == 1;
+  bool in_place = grey_into && into->isContinuous ()
+                  && layout.tile.width == layout.size.width;
+
+  std::atomic<bool> ok (true);
+  int type = CV_8UC (layout.samples);
+
+  cv::parallel_for_ (cv::Range (0, layout.count), [&] (const cv::Range& range)
+    {
+      /* libtiff handles are not thread safe, so each of the one-per-
+         thread stripes of work opens its own.  */
+      TIFF* tif = TIFFOpen (path.c_str (), "r");
+      if (!tif)
+        {
+          ok = false;
+          return;
+        }
+
+      cv::Mat buffer;
+      if (!in_place)
+        buffer.create (layout.tile, type);
+      tmsize_t bytes = (tmsize_t)(buffer.total () * buffer.elemSize ());
+
+      for (int i = range.start; i < range.end; i++)
+        {
+          cv::Rect roi (i % layout.across * layout.tile.width,
+                        i / layout.across * layout.tile.height,
+                        layout.tile.width, layout.tile.height);
+          roi &= cv::Rect (cv::Point (), layout.size);
+
+          /* Full-width rows are contiguous in INTO, bottom edge
+             included: the read stops at the ROI's size.  */
+          uchar* dst = in_place ? into->ptr (roi.y) : buffer.data;
+          tmsize_t size = in_place ? (tmsize_t)roi.area () : bytes;
+          tmsize_t got = layout.tiled
+                         ? TIFFReadEncodedTile (tif, i, dst, size)
+                         : TIFFReadEncodedStrip (tif, i, dst, size);
+          if (got < 0)
+            {
+              ok = false;
+              continue;
+            }
+
+          if (in_place)
+            continue;
+          cv::Mat tile = buffer (cv::Rect (cv::Point (), roi.size ()));
+          if (grey_into)
+            tile.copyTo ((*into) (roi));
+          else
+            emit (roi, tile);
+        }
+
+      TIFFClose (tif);
+    }, std::max (cv::getNumThreads (), 1));
+
+  return ok;
+}
+
+static void
+to_gray (const cv::Mat& src, cv::Mat& dst)
+{
+  if (src.channels () == 1)
+    src.copyTo (dst);
+  else
+    cv::cvtColor (src, dst, src.channels () == 3 ? cv::COLOR_RGB2GRAY
+                                                 : cv::COLOR_RGBA2GRAY);
+}
+
+#endif
+
+cv::Mat
+read_gray_tiled (const std::string& path)
+{
+#ifdef WAFER_WITH_LIBTIFF
+  TiffLayout layout;
+  if (read_layout (path, layout))
+    {
+      cv::Mat gray (layout.size, CV_8U);
+      bool ok = decode_tiff (path, layout, [&] (const cv::Rect& roi,
+                                                const cv::Mat& tile)
+        {
+          cv::Mat dst = gray (roi);
+          to_gray (tile, dst);
+        }, &gray);
+      return ok ? gray : cv::Mat ();
+    }
+#endif
+
+  return cv::imread (path, cv::IMREAD_GRAYSCALE);
+}
+
+bool
+decode_tiles (const std::string& path, const TileSink& sink,
+              cv::Size* image_size, cv::Size tile_size)
+{
+#ifdef WAFER_WITH_LIBTIFF
+  TiffLayout layout;
+  if (read_layout (path, layout))
+    {
+      if (image_size)
+        *image_size = layout.size;
+      return decode_tiff (path, layout, [&] (const cv::Rect& roi,
+                                             const cv::Mat& tile)
+        {
+          if (tile.channels () == 1)
+            {
+              sink (roi, tile);
+              return;
+            }
+          cv::Mat gray;
+          to_gray (tile, gray);
+          sink (roi, gray);
+        });
+    }
+#endif
+
+  cv::Mat gray = cv::imread (path, cv::IMREAD_GRAYSCALE);
+  if (gray.empty ())
+    return false;
+
+  if (image_size)
+    *image_size = gray.size ();
+  deliver_in_tiles (gray, sink, tile_size);
+  return true;
+}
@@ -0,0 +1,482 @@
+#include "wafer_inspect.h"
+#include "image_view.h"
+#include <cstring>
+#include <functional>
+#include <mutex>
+
+struct wi_context
+{
+  int threads;
+};
+
+struct wi_recipe
+{
+  Recipe recipe;
+};
+
+struct wi_result
+{
+  InspectionResult inspection;
+  /* Guards the first analysis of a batch result's lazy table.  */
+  mutable std::once_flag analyzed;
+};
+
+static thread_local std::string last_error;
+
+template <typename Fn>
+static int
+guarded (Fn fn)
+{
+  try
+    {
+      return fn ();
+    }
+  catch (const cv::Exception& e)
+    {
+      last_error = e.what ();
+      return WI_ERROR_INTERNAL;
+    }
+  catch (const std::exception& e)
+    {
+      last_error = e.what ();
+      return WI_ERROR_INTERNAL;
+    }
+  catch (...)
+    {
+      last_error = "unknown error";
+      return WI_ERROR_INTERNAL;
+    }
+}
+
+static int
+fail (int code, const char* message)
+{
+  last_error = message;
+  return code;
+}
+
+static ImageView
+to_view (const wi_image& image)
+{
+  ImageView view;
+  view.data = image.data;
+  view.width = image.width;
+  view.height = image.height;
+  view.stride = image.stride;
+  view.format = (image.format == WI_FORMAT_BGR24) ? PixelFormat::bgr24
+                : (image.format == WI_FORMAT_BGRA32) ? PixelFormat::bgra32
+                : PixelFormat::gray8;
+  return view;
+}
+
+static bool
+valid_image (const wi_image* image)
+{
+  return image && image->data && image->width > 0 && image->height > 0
+         && image->format >= WI_FORMAT_GRAY8
+         && image->format <= WI_FORMAT_BGRA32;
+}
+
+/* Gray8 views only, optionally required to match SIZE.  */
+static bool
+valid_plane (const wi_image* image, cv::Size size = cv::Size ())
+{
+  if (!valid_image (image) || image->format != WI_FORMAT_GRAY8)
+    return false;
+  return size.area () == 0
+         || (image->width == size.width && image->height == size.height);
+}
+
+struct RecipeField
+{
+  const char* key;
+  std::function<void (Recipe&, double)> set;
+  std::function<double (const Recipe&)> get;
+};
+
+static const std::vector<RecipeField>&
+recipe_fields ()
+{
+  static const std::vector<RecipeField> fields = {
+    { "blur_size",
+      [] (Recipe& r, double v) { r.illumination.blur_size = (int)v; },
+      [] (const Recipe& r) { return (double)r.illumination.blur_size; } },
+    { "estimator",
+      [] (Recipe& r, double v)
+        { r.illumination.estimator = (BackgroundEstimator)(int)v; },
+      [] (const Recipe& r) { return (double)r.illumination.estimator; } },
+    { "decimated_blur",
+      [] (Recipe& r, double v) { r.illumination.decimated_blur = v != 0; },
+      [] (const Recipe& r) { return (double)r.illumination.decimated_blur; } },
+    { "poly_degree",
+      [] (Recipe& r, double v) { r.illumination.poly_degree = (int)v; },
+      [] (const Recipe& r) { return (double)r.illumination.poly_degree; } },
+    { "median_downsample",
+      [] (Recipe& r, double v) { r.illumination.median_downsample = (int)v; },
+      [] (const Recipe& r)
+        { return (double)r.illumination.median_downsample; } },
+    { "normalization",
+      [] (Recipe& r, double v)
+        { r.illumination.normalization = (Normalization)(int)v; },
+      [] (const Recipe& r) { return (double)r.illumination.normalization; } },
+    { "low_percentile",
+      [] (Recipe& r, double v) { r.illumination.low_percentile = (float)v; },
+      [] (const Recipe& r) { return (double)r.illumination.low_percentile; } },
+    { "high_percentile",
+      [] (Recipe& r, double v) { r.illumination.high_percentile = (float)v; },
+      [] (const Recipe& r)
+        { return (double)r.illumination.high_percentile; } },
+    { "threshold",
+      [] (Recipe& r, double v) { r.detect.threshold = (int)v; },
+      [] (const Recipe& r) { return (double)r.detect.threshold; } },
+    { "min_area",
+      [] (Recipe& r, double v) { r.detect.min_area = (int)v; },
+      [] (const Recipe& r) { return (double)r.detect.min_area; } },
+    { "clahe_clip",
+      [] (Recipe& r, double v) { r.detect.clahe_clip = v; },
+      [] (const Recipe& r) { return r.detect.clahe_clip; } },
+    { "clahe_tiles",
+      [] (Recipe& r, double v) { r.detect.clahe_tiles = { (int)v, (int)v }; },
+      [] (const Recipe& r) { return (double)r.detect.clahe_tiles.width; } },
+    { "masked_clahe",
+      [] (Recipe& r, double v) { r.detect.masked_clahe = v != 0; },
+      [] (const Recipe& r) { return (double)r.detect.masked_clahe; } },
+    { "detect_dark",
+      [] (Recipe& r, double v) { r.detect.detect_dark = v != 0; },
+      [] (const Recipe& r) { return (double)r.detect.detect_dark; } },
+    { "banded_tophat",
+      [] (Recipe& r, double v) { r.detect.banded_tophat = v != 0; },
+      [] (const Recipe& r) { return (double)r.detect.banded_tophat; } },
+    { "ccl_algorithm",
+      [] (Recipe& r, double v) { r.detect.ccl_algorithm = (int)v; },
+      [] (const Recipe& r) { return (double)r.detect.ccl_algorithm; } },
+    { "scratch_ar_high",
+      [] (Recipe& r, double v) { r.classify.scratch_ar_high = (float)v; },
+      [] (const Recipe& r) { return (double)r.classify.scratch_ar_high; } },
+    { "scratch_ar_low",
+      [] (Recipe& r, double v) { r.classify.scratch_ar_low = (float)v; },
+      [] (const Recipe& r) { return (double)r.classify.scratch_ar_low; } },
+    { "scratch_min_area",
+      [] (Recipe& r, double v) { r.classify.scratch_min_area = (float)v; },
+      [] (const Recipe& r) { return (double)r.classify.scratch_min_area; } },
+    { "cluster_min_area",
+      [] (Recipe& r, double v) { r.classify.cluster_min_area = (float)v; },
+      [] (const Recipe& r) { return (double)r.classify.cluster_min_area; } },
+    { "pass_ratio",
+      [] (Recipe& r, double v) { r.pass_ratio = (float)v; },
+      [] (const Recipe& r) { return (double)r.pass_ratio; } },
+  };
+  return fields;
+}
+
+static const RecipeField*
+find_field (const char* key)
+{
+  if (!key)
+    return nullptr;
+  for (const auto& f : recipe_fields ())
+    if (std::strcmp (f.key, key) == 0)
+      return &f;
+  return nullptr;
+}
+
+/* Batch results carry a lazy table; the first caller to ask for the
+   defects analyzes it while any others wait.  */
+static const std::vector<Defect>&
+result_defects (const wi_result* result)
+{
+  const InspectionResult& r = result->inspection;
+  std::call_once (result->analyzed, [&] { r.all_defects (); });
+  return r.all_defects ();
+}
+
+static wi_defect
+to_c_defect (const Defect& d)
+{
+  wi_defect c;
+  c.center_x = d.center.x;
+  c.center_y = d.center.y;
+  c.box_x = d.boundingBox.x;
+  c.box_y = d.boundingBox.y;
+  c.box_width = d.boundingBox.width;
+  c.box_height = d.boundingBox.height;
+  c.area = d.area;
+  c.aspect_ratio = d.ar;
+  c.length = d.length;
+  c.width = d.width;
+  c.curvature = d.curvature;
+  c.type = (d.type == "scratch") ? WI_DEFECT_SCRATCH
+           : (d.type == "cluster") ? WI_DEFECT_CLUSTER
+           : WI_DEFECT_SPECK;
+  c.polarity = (d.polarity == "dark") ? WI_POLARITY_DARK : WI_POLARITY_BRIGHT;
+  return c;
+}
+
+int
+wi_abi_version (void)
+{
+  return WI_ABI_VERSION;
+}
+
+const char*
+wi_last_error (void)
+{
+  return last_error.c_str ();
+}
+
+wi_context*
+wi_context_create (int threads)
+{
+  if (threads > 0)
+    cv::setNumThreads (threads);
+  return new wi_context { threads };
+}
+
+void
+wi_context_destroy (wi_context* ctx)
+{
+  delete ctx;
+}
+
+wi_recipe*
+wi_recipe_create (void)
+{
+  return new wi_recipe ();
+}
+
+void
+wi_recipe_destroy (wi_recipe* recipe)
+{
+  delete recipe;
+}
+
+int
+wi_recipe_set (wi_recipe* recipe, const char* key, double value)
+{
+  if (!recipe)
+    return fail (WI_ERROR_ARGUMENT, "null recipe");
+
+  const RecipeField* field = find_field (key);
+  if (!field)
+    return fail (WI_ERROR_UNKNOWN_KEY, "unknown recipe key");
+
+  field->set (recipe->recipe, value);
+  return WI_OK;
+}
+
+int
+wi_recipe_get (const wi_recipe* recipe, const char* key, double* value)
+{
+  if (!recipe || !value)
+    return fail (WI_ERROR_ARGUMENT, "null argument");
+
+  const RecipeField* field = find_field (key);
+  if (!field)
+    return fail (WI_ERROR_UNKNOWN_KEY, "unknown recipe key");
+
+  *value = field->get (recipe->recipe);
+  return WI_OK;
+}
+
+int
+wi_recipe_set_tophat_scales (wi_recipe* recipe, const int* scales,
+                             size_t count)
+{
+  if (!recipe || !scales || count == 0)
+    return fail (WI_ERROR_ARGUMENT, "empty scale list");
+
+  recipe->recipe.detect.tophat_scales.assign (scales, scales + count);
+  return WI_OK;
+}
+
+int
+wi_extract_lens_mask (wi_context* ctx, const wi_image* gray,
+                      wi_image* mask_out)
+{
+  if (!ctx || !valid_plane (gray)
+      || !valid_plane (mask_out, { gray->width, gray->height }))
+    return fail (WI_ERROR_ARGUMENT, "invalid image");
+
+  return guarded ([&] {
+    cv::Mat out = wrap_view (to_view (*mask_out));
+    extract_lens_mask (wrap_view (to_view (*gray))).copyTo (out);
+    return WI_OK;
+  });
+}
+
+int
+wi_correct_illumination (wi_context* ctx, const wi_recipe* recipe,
+                         const wi_image* gray, const wi_image* mask,
+                         wi_image* corrected_out)
+{
+  if (!ctx || !recipe || !valid_plane (gray))
+    return fail (WI_ERROR_ARGUMENT, "invalid argument");
+
+  cv::Size size (gray->width, gray->height);
+  if (!valid_plane (mask, size) || !valid_plane (corrected_out, size))
+    return fail (WI_ERROR_ARGUMENT, "invalid image");
+
+  return guarded ([&] {
+    cv::Mat out = wrap_view (to_view (*corrected_out));
+    correct_illumination (wrap_view (to_view (*gray)),
+                          wrap_view (to_view (*mask)),
+                          recipe->recipe.illumination, out);
+    return WI_OK;
+  });
+}
+
+int
+wi_detect_defects (wi_context* ctx, const wi_recipe* recipe,
+                   const wi_image* corrected, const wi_image* mask,
+                   wi_image* defect_mask_out)
+{
+  if (!ctx || !recipe || !valid_plane (corrected))
+    return fail (WI_ERROR_ARGUMENT, "invalid argument");
+
+  cv::Size size (corrected->width, corrected->height);
+  if (!valid_plane (mask, size) || !valid_plane (defect_mask_out, size))
+    return fail (WI_ERROR_ARGUMENT, "invalid image");
+
+  return guarded ([&] {
+    cv::Mat out = wrap_view (to_view (*defect_mask_out));
+    detect_defects (wrap_view (to_view (*corrected)),
+                    wrap_view (to_view (*mask)), recipe->recipe.detect, out);
+    return WI_OK;
+  });
+}
+
+int
+wi_analyze_defects (wi_context* ctx, const wi_image* defect_mask,
+                    wi_result** result_out)
+{
+  if (!ctx || !valid_plane (defect_mask) || !result_out)
+    return fail (WI_ERROR_ARGUMENT, "invalid argument");
+
+  return guarded ([&] {
+    auto result = new wi_result ();
+    result->inspection.defects
+      = analyze_defects (wrap_view (to_view (*defect_mask)));
+    *result_out = result;
+    return WI_OK;
+  });
+}
+
+int
+wi_inspect (wi_context* ctx, const wi_recipe* recipe, const wi_image* input,
+            wi_image* corrected_out, wi_image* defect_mask_out,
+            wi_result** result_out)
+{
+  if (!ctx || !recipe || !valid_image (input) || !result_out)
+    return fail (WI_ERROR_ARGUMENT, "invalid argument");
+
+  cv::Size size (input->width, input->height);
+  if ((corrected_out && !valid_plane (corrected_out, size))
+      || (defect_mask_out && !valid_plane (defect_mask_out, size)))
+    return fail (WI_ERROR_ARGUMENT, "invalid output image");
+
+  return guarded ([&] {
+    ImageView corrected, defect_mask;
+    if (corrected_out)
+      corrected = to_view (*corrected_out);
+    if (defect_mask_out)
+      defect_mask = to_view (*defect_mask_out);
+
+    auto result = new wi_result ();
+    result->inspection
+      = inspect_view (to_view (*input), recipe->recipe,
+                      corrected_out ? &corrected : nullptr,
+                      defect_mask_out ? &defect_mask : nullptr);
+    /* Only the verdict and defects are exposed, and the corrected image
+       and defect mask may alias the caller's buffers.  */
+    result->inspection.mask.release ();
+    result->inspection.corrected.release ();
+    result->inspection.defect_mask.release ();
+    *result_out = result;
+    return WI_OK;
+  });
+}
+
+int
+wi_inspect_batch (wi_context* ctx, const wi_recipe* recipe,
+                  const wi_image* inputs, size_t count,
+                  wi_result** results_out)
+{
+  if (!ctx || !recipe || (count && (!inputs || !results_out)))
+    return fail (WI_ERROR_ARGUMENT, "invalid argument");
+
+  for (size_t i = 0; i < count; i++)
+    {
+      results_out[i] = nullptr;
+      if (!valid_image (&inputs[i]))
+        return fail (WI_ERROR_ARGUMENT, "invalid image in batch");
+    }
+
+  return guarded ([&] {
+    std::vector<cv::Mat> grays (count);
+    for (size_t i = 0; i < count; i++)
+      {
+        cv::Mat frame = wrap_view (to_view (inputs[i]));
+        if (inputs[i].format == WI_FORMAT_GRAY8)
+          grays[i] = frame;
+        else
+          cv::cvtColor (frame, grays[i], inputs[i].format == WI_FORMAT_BGR24
+                                         ? cv::COLOR_BGR2GRAY
+                                         : cv::COLOR_BGRA2GRAY);
+      }
+
+    std::vector<InspectionResult> inspections
+      = analyze_batch (grays, recipe->recipe);
+    for (size_t i = 0; i < count; i++)
+      {
+        results_out[i] = new wi_result ();
+        results_out[i]->inspection = std::move (inspections[i]);
+      }
+    return WI_OK;
+  });
+}
+
+void
+wi_result_destroy (wi_result* result)
+{
+  delete result;
+}
+
+int
+wi_result_pass (const wi_result* result)
+{
+  return result ? (int)result->inspection.pass : 0;
+}
+
+double
+wi_result_ratio (const wi_result* result)
+{
+  return result ? result->inspection.ratio : 0.0;
+}
+
+size_t
+wi_result_defect_count (const wi_result* result)
+{
+  return result ? result->inspection.defect_count () : 0;
+}
+
+size_t
+wi_result_defects (const wi_result* result, wi_defect* defects,
+                   size_t capacity)
+{
+  last_error.clear ();
+  if (!result || !defects)
+    return 0;
+
+  /* The first call analyzes a batch result; keep its exceptions on this
+     side of the C boundary.  A throwing analysis leaves ANALYZED unset,
+     so a later call retries it.  */
+  size_t n = 0;
+  int status = guarded ([&] {
+    const std::vector<Defect>& all = result_defects (result);
+    n = std::min (capacity, all.size ());
+    for (size_t i = 0; i < n; i++)
+      defects[i] = to_c_defect (all[i]);
+    return WI_OK;
+  });
+  return status == WI_OK ? n : 0;
+}
\ No newline at end of file
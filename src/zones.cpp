@@ -0,0 +1,84 @@
+#include "zones.h"
+
+WaferGeometry
+fit_wafer_geometry (const cv::Mat& mask)
+{
+  WaferGeometry geometry;
+
+  cv::Moments m = cv::moments (mask, true);
+  if (m.m00 <= 0.0)
+    return geometry;
+
+  geometry.center = { (float)(m.m10 / m.m00), (float)(m.m01 / m.m00) };
+  geometry.radius = (float)std::sqrt (m.m00 / CV_PI);
+
+  return geometry;
+}
+
+ZoneMap
+build_zone_map (cv::Size size, const WaferGeometry& geometry,
+                const std::vector<float>& outer_radii)
+{
+  ZoneMap map;
+  map.size = size;
+  map.row_start.reserve (size.height + 1);
+
+  int zones = (int)outer_radii.size ();
+  float cx = geometry.center.x;
+
+  /* Row Y's pixels within radius R of the centre form the interval
+     [A, B]; each zone is its disc's interval minus the next inner one.  */
+  std::vector<int> a (zones), b (zones);
+
+  for (int y = 0; y < size.height; y++)
+    {
+      map.row_start.push_back ((int)map.spans.size ());
+
+      float dy = y + 0.5f - geometry.center.y;
+      for (int k = 0; k < zones; k++)
+        {
+          float r = outer_radii[k] * geometry.radius;
+          float h2 = r * r - dy * dy;
+          if (h2 < 0.0f)
+            {
+              a[k] = 1;
+              b[k] = 0;
+              continue;
+            }
+          float h = std::sqrt (h2);
+          a[k] = std::max ((int)std::ceil (cx - h - 0.5f), 0);
+          b[k] = std::min ((int)std::floor (cx + h - 0.5f), size.width - 1);
+        }
+
+      auto push = [&] (int x0, int x1, int zone)
+        {
+          if (x0 <= x1)
+            map.spans.push_back ({ x0, x1, zone });
+        };
+
+      for (int k = zones - 1; k >= 0; k--)
+        {
+          bool inner = k > 0 && a[k - 1] <= b[k - 1];
+          push (a[k], inner ? a[k - 1] - 1 : b[k], k);
+        }
+      for (int k = 1; k < zones; k++)
+        if (a[k - 1] <= b[k - 1])
+          push (b[k - 1] + 1, b[k], k);
+    }
+
+  map.row_start.push_back ((int)map.spans.size ());
+  return map;
+}
+
+int
+zone_at (const ZoneMap& map, cv::Point p)
+{
+  if (p.y < 0 || p.y >= map.size.height)
+    return -1;
+
+  for (int i = map.row_start[p.y]; i < map.row_start[p.y + 1]; i++)
+    if (p.x >= map.spans[i].x0 && p.x <= map.spans[i].x1)
+      return map.spans[i].zone;
+
+  return -1;
+}
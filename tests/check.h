@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+/* Reports a failed condition with its location and ends the test with a
+   nonzero status, which CTest counts as a failure.  */
+#define CHECK(cond)                                                     \
+  do                                                                    \
+    {                                                                   \
+      if (!(cond))                                                      \
+        {                                                               \
+          std::fprintf (stderr, "%s:%d: CHECK (%s) failed\n",           \
+                        __FILE__, __LINE__, #cond);                     \
+          std::exit (1);                                                \
+        }                                                               \
+    }                                                                   \
+  while (0)
@@ -0,0 +1,62 @@
+#include "check.h"
+#include "morphology.h"
+
+/* The 3x3 elliptical opening detect_defects used before area_open.  */
+static cv::Mat
+old_open (const cv::Mat& binary)
+{
+  cv::Mat kernel = cv::getStructuringElement (cv::MORPH_ELLIPSE, { 3, 3 });
+  cv::Mat opened;
+  cv::morphologyEx (binary, opened, cv::MORPH_OPEN, kernel);
+  return opened;
+}
+
+static cv::Mat
+opened_by_area (const cv::Mat& binary, int min_area)
+{
+  cv::Mat out = binary.clone ();
+  area_open (out, min_area);
+  return out;
+}
+
+int
+main ()
+{
+  /* Every pixel the old opening kept lies on a plus of five pixels, so
+     its component has at least five and area_open (5) keeps it too.  */
+  cv::RNG rng (77);
+  for (int trial = 0; trial < 20; trial++)
+    {
+      cv::Mat noise (64, 64, CV_8U);
+      rng.fill (noise, cv::RNG::UNIFORM, 0, 256);
+      cv::Mat binary = noise > 200;
+
+      cv::Mat area = opened_by_area (binary, 5);
+      cv::Mat lost = old_open (binary) & ~area;
+      CHECK (cv::countNonZero (lost) == 0);
+    }
+
+  /* Unlike the opening, area_open keeps the kept components whole and
+     keeps thin shapes of five pixels or more.  */
+  cv::Mat shapes = cv::Mat::zeros (32, 32, CV_8U);
+  cv::line (shapes, { 2, 2 }, { 2, 12 }, 255);     /* 11 px line.  */
+  cv::line (shapes, { 8, 2 }, { 8, 5 }, 255);      /* 4 px line.  */
+  shapes.at<uchar> (20, 20) = 255;                 /* Speck.  */
+  cv::rectangle (shapes, { 15, 5 }, { 19, 9 }, 255, cv::FILLED);
+
+  cv::Mat area = opened_by_area (shapes, 5);
+  CHECK (area.at<uchar> (7, 2) == 255);
+  CHECK (cv::countNonZero (old_open (shapes).col (2)) == 0);
+  CHECK (cv::countNonZero (area.col (8)) == 0);
+  CHECK (area.at<uchar> (20, 20) == 0);
+  CHECK (cv::countNonZero (area (cv::Rect (15, 5, 5, 5))) == 25);
+  CHECK (cv::countNonZero (area) == 11 + 25);
+
+  /* Pixel values are left as they are, e.g. DEFECT_DARK marks.  */
+  cv::Mat marked = cv::Mat::zeros (shapes.size (), CV_8U);
+  marked.setTo (128, shapes);
+  area_open (marked, 5);
+  CHECK (marked.at<uchar> (7, 2) == 128);
+  CHECK (marked.at<uchar> (20, 20) == 0);
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include "check.h"
+#include "outline.h"
+
+/* Every boundary findContours traces on SHAPE survives encode_chain and
+   decode_chain point for point.  */
+static void
+check_round_trip (const cv::Mat& shape)
+{
+  std::vector<std::vector<cv::Point>> contours;
+  cv::findContours (shape, contours, cv::RETR_EXTERNAL,
+                    cv::CHAIN_APPROX_NONE);
+  CHECK (!contours.empty ());
+
+  for (const auto& contour : contours)
+    {
+      ChainCode chain = encode_chain (contour);
+      CHECK (chain.points == contour.size ());
+      CHECK (chain.bits.size () == ((contour.size () - 1) * 3 + 7) / 8);
+      CHECK (decode_chain (chain) == contour);
+    }
+}
+
+int
+main ()
+{
+  /* A single pixel: no steps at all.  */
+  cv::Mat dot = cv::Mat::zeros (8, 8, CV_8U);
+  dot.at<uchar> (3, 4) = 255;
+  check_round_trip (dot);
+
+  /* A filled disc and a thin diagonal line use all eight directions,
+     and their codes straddle byte boundaries.  */
+  cv::Mat disc = cv::Mat::zeros (64, 64, CV_8U);
+  cv::circle (disc, { 30, 33 }, 17, 255, cv::FILLED);
+  check_round_trip (disc);
+
+  cv::Mat line = cv::Mat::zeros (64, 64, CV_8U);
+  cv::line (line, { 5, 50 }, { 58, 9 }, 255, 1);
+  check_round_trip (line);
+
+  /* Random blobs.  */
+  cv::RNG rng (99);
+  for (int trial = 0; trial < 20; trial++)
+    {
+      cv::Mat noise (48, 48, CV_8U);
+      rng.fill (noise, cv::RNG::UNIFORM, 0, 256);
+      cv::GaussianBlur (noise, noise, { 7, 7 }, 0);
+      cv::Mat blobs = noise > 130;
+      if (cv::countNonZero (blobs))
+        check_round_trip (blobs);
+    }
+
+  CHECK (encode_chain ({}).points == 0);
+  CHECK (decode_chain (ChainCode ()).empty ());
+  return 0;
+}
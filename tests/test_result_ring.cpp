@@ -0,0 +1,92 @@
+#include "check.h"
+#include "result_ring.h"
+
+static Defect
+make_defect (float x, const char* type, const char* polarity)
+{
+  Defect d;
+  d.center = { x, 2.0f * x };
+  d.boundingBox = cv::Rect ((int)x, 3, 4, 5);
+  d.area = 10.0f * x;
+  d.ar = 1.5f;
+  d.type = type;
+  d.polarity = polarity;
+  d.zone = 1;
+  return d;
+}
+
+int
+main ()
+{
+  /* Unique per run, so parallel test runs do not share a ring.  */
+  std::string name = cv::format ("wafer_test_ring_%lld",
+                                 (long long)cv::getTickCount ());
+  RingLayout layout;
+  layout.slots = 4;
+  layout.max_defects = 2;
+  layout.display_bytes = 32 * 32;
+
+  auto publisher = new ResultPublisher (name, layout);
+  CHECK (publisher->is_open ());
+
+  ResultSubscriber subscriber (name);
+  CHECK (subscriber.is_open ());
+  CHECK (!subscriber.retired ());
+  CHECK (subscriber.latest () == 0);
+
+  ResultView view;
+  CHECK (!subscriber.view (1, view));
+
+  /* Three defects in a ring holding two: counted, not all stored.  */
+  InspectionResult result;
+  result.defects = { make_defect (1.0f, "scratch", "dark"),
+                     make_defect (2.0f, "cluster", "bright"),
+                     make_defect (3.0f, "speck", "bright") };
+  result.pass = false;
+  result.ratio = 0.25f;
+  cv::Mat display (32, 32, CV_8U);
+  cv::randu (display, 0, 256);
+
+  CHECK (publisher->publish (result, display, 42) == 1);
+  CHECK (subscriber.latest () == 1);
+  CHECK (subscriber.view (1, view));
+  CHECK (view.sequence == 1 && view.wafer_id == 42);
+  CHECK (!view.pass && view.ratio == 0.25f);
+  CHECK (view.total_defects == 3 && view.defect_count == 2);
+  CHECK (view.center_x[1] == 2.0f && view.center_y[1] == 4.0f);
+  CHECK (view.box_x[0] == 1 && view.box_height[0] == 5);
+  CHECK (view.area[1] == 20.0f);
+  CHECK (view.type[0] == 1 && view.type[1] == 2);
+  CHECK (view.polarity[0] == 1 && view.polarity[1] == 0);
+  CHECK (view.zone[0] == 1);
+  CHECK (cv::countNonZero (view.display != display) == 0);
+  CHECK (view.valid ());
+
+  /* A display larger than the slot's room is left out.  */
+  CHECK (publisher->publish (result, cv::Mat (64, 64, CV_8U)) == 2);
+  ResultView second;
+  CHECK (subscriber.view (2, second) && second.display.empty ());
+
+  /* Once the ring wraps, the first slot is reused and its views
+     turn invalid.  */
+  for (int i = 0; i < 3; i++)
+    publisher->publish (result);
+  CHECK (subscriber.latest () == 5);
+  CHECK (!view.valid ());
+  CHECK (!subscriber.view (1, view));
+  CHECK (subscriber.view (5, view) && view.valid ());
+
+  /* A restarted publisher retires the old segment; reopening starts
+     the sequence again.  */
+  delete publisher;
+  CHECK (subscriber.retired ());
+
+  ResultPublisher restarted (name, layout);
+  CHECK (restarted.is_open ());
+  CHECK (subscriber.reopen ());
+  CHECK (!subscriber.retired ());
+  CHECK (subscriber.latest () == 0);
+  CHECK (restarted.publish (result) == 1);
+  CHECK (subscriber.view (1, view) && view.defect_count == 2);
+  return 0;
+}
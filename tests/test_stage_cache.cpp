@@ -0,0 +1,57 @@
+#include "check.h"
+#include "stage_cache.h"
+
+int
+main ()
+{
+  cv::Mat gray (333, 257, CV_8U);
+  cv::RNG (97).fill (gray, cv::RNG::UNIFORM, 0, 256);
+  IlluminationParams params;
+
+  /* The key depends on the pixels only: not on the buffer, its row
+     padding or the thread count hashing it.  */
+  std::string key = StageCache::key (gray, params);
+  CHECK (StageCache::key (gray.clone (), params) == key);
+
+  cv::Mat padded (gray.rows + 2, gray.cols + 5, CV_8U, cv::Scalar (7));
+  gray.copyTo (padded (cv::Rect (3, 1, gray.cols, gray.rows)));
+  CHECK (StageCache::key (padded (cv::Rect (3, 1, gray.cols, gray.rows)),
+                          params) == key);
+
+  int threads = cv::getNumThreads ();
+  cv::setNumThreads (1);
+  CHECK (StageCache::key (gray, params) == key);
+  cv::setNumThreads (threads);
+
+  /* Any pixel, the size and every illumination parameter change it.  */
+  cv::Mat changed = gray.clone ();
+  changed.at<uchar> (200, 100) ^= 1;
+  CHECK (StageCache::key (changed, params) != key);
+  CHECK (StageCache::key (gray (cv::Rect (0, 0, 257, 332)), params) != key);
+
+  IlluminationParams blur = params;
+  blur.blur_size += 2;
+  CHECK (StageCache::key (gray, blur) != key);
+  IlluminationParams estimator = params;
+  estimator.estimator = BackgroundEstimator::polynomial;
+  CHECK (StageCache::key (gray, estimator) != key);
+  IlluminationParams percentile = params;
+  percentile.high_percentile = 99.0f;
+  CHECK (StageCache::key (gray, percentile) != key);
+
+  /* A stored entry loads back unchanged, also after a restart.  */
+  cv::Mat mask = gray > 100;
+  cv::Mat corrected = 255 - gray;
+  {
+    StageCache cache (".", 64 << 20);
+    cache.store (key, mask, corrected);
+  }
+  StageCache cache (".", 64 << 20);
+  cv::Mat mask_in, corrected_in;
+  CHECK (cache.load (key, mask_in, corrected_in));
+  CHECK (cv::countNonZero (mask_in != mask) == 0);
+  CHECK (cv::countNonZero (corrected_in != corrected) == 0);
+  CHECK (!cache.load (StageCache::key (changed, params), mask_in,
+                      corrected_in));
+  return 0;
+}
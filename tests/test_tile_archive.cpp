@@ -0,0 +1,60 @@
+#include "check.h"
+#include "tile_archive.h"
+
+static bool
+same (const cv::Mat& a, const cv::Mat& b)
+{
+  return a.size () == b.size () && a.type () == b.type ()
+         && cv::countNonZero (a != b) == 0;
+}
+
+int
+main ()
+{
+  /* Not a multiple of the tile size, so the last row and column of
+     tiles are partial.  */
+  cv::Mat gray (300, 520, CV_8U);
+  cv::RNG (96).fill (gray, cv::RNG::UNIFORM, 0, 256);
+  cv::GaussianBlur (gray, gray, { 5, 5 }, 0);
+
+  std::string path = "test_tile_archive.wta";
+  CHECK (write_tile_archive (path, gray, { 128, 128 }));
+  CHECK (tile_archive_size (path) == gray.size ());
+
+  /* Crops inside one tile, across tile corners, on the partial edge
+     tiles and partly outside the image.  */
+  const cv::Rect crops[] = {
+    { 10, 20, 30, 40 },
+    { 100, 100, 60, 60 },
+    { 500, 280, 20, 20 },
+    { 480, 250, 100, 100 },
+    { 0, 0, 520, 300 }
+  };
+  for (const cv::Rect& roi : crops)
+    {
+      cv::Mat crop;
+      CHECK (read_tile_archive (path, roi, crop));
+      cv::Rect area = roi & cv::Rect (cv::Point (), gray.size ());
+      CHECK (same (crop, gray (area)));
+    }
+
+  /* Rewriting replaces the archive in place.  */
+  cv::Mat other = 255 - gray;
+  CHECK (write_tile_archive (path, other, { 64, 64 }));
+  cv::Rect roi (200, 100, 90, 90);
+  cv::Mat crop;
+  CHECK (read_tile_archive (path, roi, crop));
+  CHECK (same (crop, other (roi)));
+
+  {
+    TileArchiveWriter writer ({ 128, 128 });
+    writer.submit (path, gray);
+    CHECK (writer.flush () == 0);
+  }
+  CHECK (read_tile_archive (path, { 0, 0, 520, 300 }, crop));
+  CHECK (same (crop, gray));
+
+  CHECK (!read_tile_archive ("missing.wta", { 0, 0, 8, 8 }, crop));
+  std::remove (path.c_str ());
+  return 0;
+}